@@ -19,6 +19,7 @@
 #define _SCULL_H_
 
 #include <linux/ioctl.h> /* needed for the _IOW etc stuff used later */
+#include <linux/types.h> /* __u32 etc, for the ioctl structures */
 
 /*
  * Macros to help debugging
@@ -54,15 +55,18 @@
 
 /*
  * The bare device is a variable-length region of memory.
- * Use a linked list of indirect blocks.
+ * Use an xarray of indirect blocks, indexed by quantum-set number.
  *
- * "scull_dev->data" points to an array of pointers, each
- * pointer refers to a memory area of SCULL_QUANTUM bytes.
+ * Each entry in "scull_dev->qsets" points to an array of pointers,
+ * each pointer refers to a memory area of SCULL_QUANTUM bytes.
  *
  * The array (quantum-set) is SCULL_QSET long.
+ *
+ * A quantum that is a multiple of the page size is backed by whole
+ * pages and can be mmap()ed, so the default is one (4k) page.
  */
 #ifndef SCULL_QUANTUM
-#define SCULL_QUANTUM 4000
+#define SCULL_QUANTUM 4096
 #endif
 
 #ifndef SCULL_QSET
@@ -70,27 +74,92 @@
 #endif
 
 /*
- * The pipe device is a simple circular buffer. Here its default size
+ * The pipe device is a simple circular buffer. Here its default size;
+ * it is rounded up to a power of two.
  */
 #ifndef SCULL_P_BUFFER
-#define SCULL_P_BUFFER 4000
+#define SCULL_P_BUFFER 4096
+#endif
+
+/*
+ * Upper bound for a pipe buffer, whether set through SCULL_P_IOCTSIZE
+ * or grown adaptively (SCULL_P_IOCTADAPT).
+ */
+#ifndef SCULL_P_MAX_BUFFER
+#define SCULL_P_MAX_BUFFER (16 << 20)
 #endif
 
 /*
- * Representation of scull quantum sets.
+ * Per-device statistics, kept per CPU and exported through debugfs as
+ * scull/<device>/stats. Latencies are counted in log2(ns) buckets.
+ */
+enum {
+	SCULL_STAT_READ,
+	SCULL_STAT_WRITE,
+	SCULL_STAT_IOCTL,
+	SCULL_STAT_NR_OPS
+};
+
+#define SCULL_STAT_BUCKETS 32
+
+struct scull_stats_cpu {
+	u64 ops[SCULL_STAT_NR_OPS];
+	u64 bytes[SCULL_STAT_NR_OPS];
+	u64 errors[SCULL_STAT_NR_OPS];
+	u64 eagain[SCULL_STAT_NR_OPS];
+	u64 lat[SCULL_STAT_NR_OPS][SCULL_STAT_BUCKETS];
+	u64 contended;            /* lock acquisitions that had to wait */
+	u64 blocked_ns;           /* time spent sleeping for data/room */
+};
+
+struct seq_file;
+
+struct scull_stats {
+	struct scull_stats_cpu __percpu *cpu;
+	struct dentry *dir;
+	void (*show)(struct seq_file *m, void *priv); /* device specific */
+	void *priv;
+};
+
+/*
+ * Representation of scull quantum sets. The data path holds the
+ * device's sem shared and takes the set's own for the quanta in it.
  */
 struct scull_qset {
 	void **data;
-	struct scull_qset *next;
+	unsigned long atime;      /* jiffies of the last access */
+	bool prealloc;            /* fallocated: kept even when all zeros */
+	struct rw_semaphore sem;  /* guards data and the quanta */
 };
 
-struct scull_dev {
-	struct scull_qset *data;  /* Pointer to first quantum set */
+struct scull_cow;
+struct mem_cgroup;
+
+/*
+ * The data of a device and the geometry it is laid out in. Changing
+ * the geometry builds a new tree and swaps it in.
+ */
+struct scull_tree {
+	struct xarray qsets;      /* Quantum sets, by set number */
 	int quantum;              /* the current quantum size */
 	int qset;                 /* the current array size */
-	unsigned long size;       /* amount of data stored here */
+	int qshift;               /* log2(quantum), or -1 */
+	int ishift;               /* log2(quantum * qset), or -1 */
+	struct scull_cow *cow;    /* the trees it was cloned with, or NULL */
+	struct mem_cgroup *memcg; /* charged for its compressed quanta */
+	atomic_long_t zquanta;    /* compressed quanta */
+	atomic_long_t zbytes;     /* and the bytes they take */
+	struct work_struct free_work; /* frees the tree once detached */
+};
+
+struct scull_dev {
+	struct scull_tree *tree;  /* the data, under sem */
+	atomic64_t size;          /* amount of data stored here */
 	unsigned int access_key;  /* used by sculluid and scullpriv */
-	struct semaphore sem;     /* mutual exclusion semaphore     */
+	atomic_t mapped;          /* user mappings, which pin the geometry */
+	unsigned long reclaim;    /* quantum set the shrinker goes on from */
+	struct rw_semaphore sem;  /* shared by I/O, exclusive for the tree */
+	struct scull_stats stats;
 	struct cdev cdev;	  /* Char device structure		*/
 };
 
@@ -106,7 +175,7 @@ struct scull_dev {
  */
 extern int scull_major;     /* main.c */
 extern int scull_nr_devs;
-extern int scull_quantum;
+extern int scull_quantum;   /* defaults for new devices */
 extern int scull_qset;
 
 extern int scull_p_buffer;	/* pipe.c */
@@ -121,12 +190,24 @@ void    scull_p_cleanup(void);
 int     scull_access_init(dev_t dev);
 void    scull_access_cleanup(void);
 
-int     scull_trim(struct scull_dev *dev);
+int     scull_trim(struct scull_dev *dev, struct address_space *mapping);
+
+void    scull_stats_setup(void);
+void    scull_stats_teardown(void);
+void    scull_stats_init(struct scull_stats *st, const char *name,
+                         void (*show)(struct seq_file *, void *), void *priv);
+void    scull_stats_cleanup(struct scull_stats *st);
+void    scull_stats_account(struct scull_stats *st, int op, long ret, u64 start);
+void    scull_stats_contended(struct scull_stats *st);
+void    scull_stats_blocked(struct scull_stats *st, u64 start);
+void    scull_stats_reset(struct scull_stats *st);
 
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count,
                    loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count,
                     loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 loff_t  scull_llseek(struct file *filp, loff_t off, int whence);
 long    scull_ioctl(struct file *filp,
                     unsigned int cmd, unsigned long arg);
@@ -149,6 +230,9 @@ long    scull_ioctl(struct file *filp,
  * Q means "Query": response is on the return value
  * X means "eXchange": switch G and S atomically
  * H means "sHift": switch T and Q atomically
+ *
+ * These act on the scull device they are issued on, relaying out its
+ * data; SCULL_IOCRESET restores the module defaults.
  */
 #define SCULL_IOCSQUANTUM _IOW(SCULL_IOC_MAGIC,  1, int)
 #define SCULL_IOCSQSET    _IOW(SCULL_IOC_MAGIC,  2, int)
@@ -170,8 +254,80 @@ long    scull_ioctl(struct file *filp,
  */
 #define SCULL_P_IOCTSIZE _IO(SCULL_IOC_MAGIC,   13)
 #define SCULL_P_IOCQSIZE _IO(SCULL_IOC_MAGIC,   14)
+/* Adaptive ring size: grow under backpressure up to arg bytes, 0 = off */
+#define SCULL_P_IOCTADAPT _IO(SCULL_IOC_MAGIC,  15)
+#define SCULL_P_IOCQADAPT _IO(SCULL_IOC_MAGIC,  16)
+/* Packet mode: every write() is a record, every read() returns one */
+#define SCULL_P_IOCTPACKET _IO(SCULL_IOC_MAGIC, 17)
+#define SCULL_P_IOCQPACKET _IO(SCULL_IOC_MAGIC, 18)
+
+/*
+ * Batched receive for packet mode, in the spirit of recvmmsg(2): fills
+ * up to vlen buffers with one record each and returns how many it got.
+ * msg_len is the full record length, larger than len if it was
+ * truncated.
+ */
+struct scull_p_msg {
+	__u64 buf;		/* user buffer */
+	__u32 len;		/* its size */
+	__u32 msg_len;		/* out: length of the record */
+};
+
+struct scull_p_mmsg {
+	__u64 msgs;		/* array of struct scull_p_msg */
+	__u32 vlen;		/* number of entries */
+	__u32 flags;		/* must be zero */
+};
+
+#define SCULL_P_IOCRECVMMSG _IOW(SCULL_IOC_MAGIC, 19, struct scull_p_mmsg)
+
+/*
+ * Broadcast mode: every reader gets the whole stream. With BLOCK,
+ * writers wait for the slowest reader; with DROP, readers that fall a
+ * full ring behind skip ahead instead.
+ */
+#define SCULL_P_BCAST_OFF   0
+#define SCULL_P_BCAST_BLOCK 1
+#define SCULL_P_BCAST_DROP  2
+
+#define SCULL_P_IOCTBCAST _IO(SCULL_IOC_MAGIC,  20)
+#define SCULL_P_IOCQBCAST _IO(SCULL_IOC_MAGIC,  21)
+
+/*
+ * Wakeup watermarks, like SO_RCVLOWAT/SO_SNDLOWAT: readers are woken
+ * (and poll reports POLLIN) once this many bytes are buffered, writers
+ * (POLLOUT) once this many bytes are free. Default 1.
+ */
+#define SCULL_P_IOCTRLOWAT _IO(SCULL_IOC_MAGIC, 22)
+#define SCULL_P_IOCQRLOWAT _IO(SCULL_IOC_MAGIC, 23)
+#define SCULL_P_IOCTWLOWAT _IO(SCULL_IOC_MAGIC, 24)
+#define SCULL_P_IOCQWLOWAT _IO(SCULL_IOC_MAGIC, 25)
+
+/* Zero the statistics of this device (scull and scullpipe alike) */
+#define SCULL_IOCSTATRESET _IO(SCULL_IOC_MAGIC, 26)
+
+/*
+ * fallocate(2) for scull devices, which the VFS does not forward to
+ * character devices. mode takes FALLOC_FL_* flags.
+ */
+struct scull_falloc {
+	__s32 mode;
+	__u32 pad;
+	__s64 offset;
+	__s64 len;
+};
+
+#define SCULL_IOCFALLOCATE _IOW(SCULL_IOC_MAGIC, 27, struct scull_falloc)
+
+/*
+ * Issued on a scull device open for writing, with the file descriptor of
+ * another one open for reading: the first becomes a copy of the second.
+ * The copy shares the quanta, which are duplicated on the first write
+ * from either side, so it is cheap however large the device is.
+ */
+#define SCULL_IOCCLONE _IO(SCULL_IOC_MAGIC, 28)
 /* ... more to come */
 
-#define SCULL_IOC_MAXNR 14
+#define SCULL_IOC_MAXNR 28
 
 #endif /* _SCULL_H_ */
@@ -4,12 +4,36 @@
 #include <linux/device.h>
 #include <linux/cdev.h>
 #include <linux/slab.h>
+#include <linux/mm.h>
 #include <linux/semaphore.h>
+#include <linux/rwsem.h>
 #include <linux/sched.h>
 #include <linux/wait.h>
+#include <linux/xarray.h>
+#include <linux/uio.h>
+#include <linux/falloc.h>
+#include <linux/overflow.h>
+#include <linux/math64.h>
+#include <linux/log2.h>
+#include <linux/shrinker.h>
+#include <linux/workqueue.h>
+#include <linux/string.h>
+#include <linux/sched/clock.h>
+#include <linux/seq_file.h>
+#include <linux/file.h>
+#include <linux/mutex.h>
+#include <linux/lz4.h>
+#include <linux/jiffies.h>
+#include <linux/uaccess.h>
+#include <linux/refcount.h>
+#include <linux/memcontrol.h>
+#include <linux/sched/mm.h>
 #include <asm/uaccess.h>
 #include "scull.h"
 
+#define CREATE_TRACE_POINTS
+#include "scull_trace.h"
+
 MODULE_LICENSE("Dual BSD/GPL");
 
 int scull_quantum = SCULL_QUANTUM;
@@ -17,6 +41,14 @@ int scull_qset = SCULL_QSET;
 module_param(scull_quantum, int, S_IRUGO);
 module_param(scull_qset, int, S_IRUGO);
 
+/* Number of spare quanta kept aside, so that writes need not allocate */
+int scull_pool = 0;
+module_param(scull_pool, int, S_IRUGO);
+
+/* Cap on the bytes of data held by all scull devices together, 0 = none */
+long scull_max_bytes = 0;
+module_param(scull_max_bytes, long, S_IRUGO | S_IWUSR);
+
 static dev_t scull_devno;
 static struct class *scull_class = NULL;
 
@@ -25,68 +57,770 @@ struct scull_dev scull_devs[4];
 loff_t scull_llseek(struct file *filp, loff_t off, int whence);
 ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos);
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos);
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to);
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from);
 long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg);
+int scull_mmap(struct file *filp, struct vm_area_struct *vma);
+long scull_fallocate(struct file *filp, int mode, loff_t offset, loff_t len);
 int scull_open(struct inode *inode, struct file *filp);
 int scull_release(struct inode *inode, struct file *filp);
 
-int scull_trim(struct scull_dev *dev)
+extern struct file_operations scull_fops;
+
+/*
+ * Slab caches for the quantum set nodes, and for pointer arrays and
+ * quanta of the size given at load time (the one almost every device
+ * uses). Devices reconfigured to another geometry fall back to kmalloc.
+ */
+static struct kmem_cache *scull_qset_cache;
+static struct kmem_cache *scull_data_cache;
+static struct kmem_cache *scull_quantum_cache;
+static int scull_cache_quantum, scull_cache_qset;
+
+/*
+ * The reserve: up to scull_pool quanta of scull_cache_quantum bytes,
+ * chained through their first word. Freed quanta go back here first.
+ */
+static DEFINE_SPINLOCK(scull_pool_lock);
+static void *scull_pool_head;
+static int scull_pool_count;
+
+/* Quanta in use by the devices, and their size in bytes */
+static atomic_long_t scull_quanta;
+static atomic_long_t scull_bytes;
+
+static struct shrinker *scull_shrinker;
+
+/*
+ * Quanta that may have been left holding only zeros since the shrinker
+ * last looked; what it reports as freeable besides the reserve.
+ */
+static atomic_long_t scull_zero_hint;
+
+/* Detached trees are freed here, away from whoever detached them */
+static struct workqueue_struct *scull_wq;
+
+/*
+ * Quanta shared between trees by SCULL_IOCCLONE, by address, with the
+ * number of other trees holding each. A quantum that is not in here
+ * has a single owner. Only trees that were cloned can hold shared
+ * quanta, so the others never look.
+ */
+static DEFINE_MUTEX(scull_share_lock);
+static DEFINE_XARRAY(scull_shared);
+
+/*
+ * Trees cloned from one another, and how many quanta are shared among
+ * them; a quantum is only ever shared within one such group. Once the
+ * count is back to zero, each tree owns all of its quanta again.
+ */
+struct scull_cow {
+    atomic_long_t shared;
+    refcount_t ref;
+};
+
+static unsigned long scull_share_index(void *data)
+{
+    return (unsigned long)data / sizeof(void *);
+}
+
+/*
+ * A compressed quantum. Its slot holds the address with the low bit
+ * set, which a quantum's never has; it still counts as data everywhere,
+ * and is inflated back into a quantum before being written to.
+ */
+struct scull_zquantum {
+    unsigned int len;
+    char data[];
+};
+
+#define SCULL_ZTAG 1UL
+
+/* Seconds a quantum set goes untouched before it is compressed, 0 = never */
+int scull_compress_age = 0;
+
+/* Any older and the age would overflow once in jiffies */
+#define SCULL_COMPRESS_MAX_AGE (INT_MAX / HZ)
+
+static struct delayed_work scull_compress_work;
+static bool scull_compress_live;  /* the work may be queued, under the param lock */
+
+/*
+ * The compressor only runs while there is an age: setting one starts it,
+ * and it stops by itself once the age is back to 0.
+ */
+static int scull_compress_age_set(const char *val, const struct kernel_param *kp)
+{
+    int age, ret = kstrtoint(val, 0, &age);
+
+    if (ret)
+        return ret;
+    age = clamp(age, 0, SCULL_COMPRESS_MAX_AGE);
+    WRITE_ONCE(scull_compress_age, age);
+    if (age && scull_compress_live)
+        mod_delayed_work(scull_wq, &scull_compress_work, age * HZ);
+    return 0;
+}
+
+static const struct kernel_param_ops scull_compress_age_ops = {
+    .set = scull_compress_age_set,
+    .get = param_get_int,
+};
+module_param_cb(scull_compress_age, &scull_compress_age_ops, &scull_compress_age,
+                S_IRUGO | S_IWUSR);
+
+static bool scull_is_compressed(void *data)
+{
+    return (unsigned long)data & SCULL_ZTAG;
+}
+
+static struct scull_zquantum *scull_zq(void *data)
+{
+    return (struct scull_zquantum *)((unsigned long)data & ~SCULL_ZTAG);
+}
+
+/*
+ * Quanta that are a whole number of pages come straight from the page
+ * allocator, so that they are page aligned and can be mapped into user
+ * space by scull_mmap().
+ */
+static void *scull_new_quantum(int quantum)
+{
+    if (quantum % PAGE_SIZE == 0)
+        return (void *)__get_free_pages(GFP_KERNEL_ACCOUNT | __GFP_ZERO | __GFP_COMP,
+                                        get_order(quantum));
+    if (quantum == scull_cache_quantum)
+        return kmem_cache_zalloc(scull_quantum_cache, GFP_KERNEL_ACCOUNT);
+    return kzalloc(quantum, GFP_KERNEL_ACCOUNT);
+}
+
+static void scull_del_quantum(int quantum, void *data)
+{
+    if (quantum % PAGE_SIZE == 0)
+        free_pages((unsigned long)data, get_order(quantum));
+    else if (quantum == scull_cache_quantum)
+        kmem_cache_free(scull_quantum_cache, data);
+    else
+        kfree(data);
+}
+
+static void *scull_pool_get(void)
+{
+    void *data;
+
+    spin_lock(&scull_pool_lock);
+    data = scull_pool_head;
+    if (data)
+    {
+        scull_pool_head = *(void **)data;
+        scull_pool_count--;
+    }
+    spin_unlock(&scull_pool_lock);
+    return data;
+}
+
+static bool scull_pool_put(void *data)
+{
+    bool ret = false;
+
+    spin_lock(&scull_pool_lock);
+    if (scull_pool_count < scull_pool)
+    {
+        *(void **)data = scull_pool_head;
+        scull_pool_head = data;
+        scull_pool_count++;
+        ret = true;
+    }
+    spin_unlock(&scull_pool_lock);
+    return ret;
+}
+
+static bool scull_charge(int quantum)
+{
+    long max = READ_ONCE(scull_max_bytes);
+
+    if (atomic_long_add_return(quantum, &scull_bytes) > max && max > 0)
+    {
+        atomic_long_sub(quantum, &scull_bytes);
+        return false;
+    }
+    atomic_long_inc(&scull_quanta);
+    return true;
+}
+
+static void scull_uncharge(int quantum)
+{
+    atomic_long_sub(quantum, &scull_bytes);
+    atomic_long_dec(&scull_quanta);
+}
+
+/* One more tree holds this quantum */
+static int scull_share(struct scull_tree *t, void *data)
+{
+    unsigned long index = scull_share_index(data);
+    void *entry;
+    int ret;
+
+    mutex_lock(&scull_share_lock);
+    entry = xa_load(&scull_shared, index);
+    ret = xa_err(xa_store(&scull_shared, index,
+                          xa_mk_value(entry ? xa_to_value(entry) + 1 : 1), GFP_KERNEL));
+    if (!ret && !entry)
+        atomic_long_inc(&t->cow->shared);
+    mutex_unlock(&scull_share_lock);
+    return ret;
+}
+
+/*
+ * One tree lets go of this quantum. Returns false if it was the last
+ * one, which then owns the quantum alone.
+ */
+static bool scull_unshare(struct scull_tree *t, void *data)
+{
+    unsigned long index = scull_share_index(data);
+    void *entry;
+
+    mutex_lock(&scull_share_lock);
+    entry = xa_load(&scull_shared, index);
+    if (entry && xa_to_value(entry) > 1)
+    {
+        xa_store(&scull_shared, index, xa_mk_value(xa_to_value(entry) - 1), GFP_KERNEL);
+    }
+    else if (entry)
+    {
+        xa_erase(&scull_shared, index);
+        atomic_long_dec(&t->cow->shared);
+    }
+    mutex_unlock(&scull_share_lock);
+    return entry != NULL;
+}
+
+/* Whether the tree may still hold quanta that other trees hold too */
+static bool scull_tree_shares(struct scull_tree *t)
+{
+    return t->cow && atomic_long_read(&t->cow->shared);
+}
+
+static bool scull_is_shared(struct scull_tree *t, void *data)
+{
+    return scull_tree_shares(t) && xa_load(&scull_shared, scull_share_index(data));
+}
+
+/*
+ * Quanta are handed out zeroed, so that holes inside a quantum read as
+ * zeros like the ones between quanta do. Returns -ENOSPC past
+ * scull_max_bytes.
+ */
+static void *scull_alloc_quantum(struct scull_tree *t)
+{
+    struct mem_cgroup *memcg;
+    void *data = NULL;
+
+    /* the first to store data here pays for it once compressed, too */
+    if (!READ_ONCE(t->memcg))
+    {
+        memcg = get_mem_cgroup_from_mm(current->mm);
+        if (cmpxchg(&t->memcg, NULL, memcg))
+            mem_cgroup_put(memcg);
+    }
+    if (!scull_charge(t->quantum))
+        return ERR_PTR(-ENOSPC);
+    if (t->quantum == scull_cache_quantum)
+        data = scull_pool_get();
+    if (data)
+    {
+        memset(data, 0, t->quantum);
+        return data;
+    }
+    data = scull_new_quantum(t->quantum);
+    if (data)
+        return data;
+    scull_uncharge(t->quantum);
+    return ERR_PTR(-ENOMEM);
+}
+
+/*
+ * A page quantum still mapped somewhere keeps its extra references and
+ * must not be handed to another device; it is released to the page
+ * allocator and goes away with the last mapping.
+ */
+static void scull_free_quantum(struct scull_tree *t, void *data)
+{
+    struct scull_zquantum *zq = scull_zq(data);
+
+    if (!data)
+        return;
+    if (scull_is_compressed(data))
+    {
+        atomic_long_dec(&t->zquanta);
+        atomic_long_sub(zq->len, &t->zbytes);
+    }
+    /* the other trees sharing it keep it, and the charge with it */
+    if (t->cow && scull_unshare(t, data))
+        return;
+    if (scull_is_compressed(data))
+    {
+        scull_uncharge(zq->len);
+        kfree(zq);
+        return;
+    }
+    scull_uncharge(t->quantum);
+    if (t->quantum == scull_cache_quantum &&
+        (t->quantum % PAGE_SIZE || page_count(virt_to_page(data)) == 1) &&
+        scull_pool_put(data))
+        return;
+    scull_del_quantum(t->quantum, data);
+}
+
+static void **scull_alloc_data(struct scull_tree *t)
+{
+    if (t->qset == scull_cache_qset)
+        return kmem_cache_zalloc(scull_data_cache, GFP_KERNEL_ACCOUNT);
+    return kcalloc(t->qset, sizeof(void *), GFP_KERNEL_ACCOUNT);
+}
+
+static void scull_free_data(struct scull_tree *t, void **data)
+{
+    if (t->qset == scull_cache_qset)
+        kmem_cache_free(scull_data_cache, data);
+    else
+        kfree(data);
+}
+
+static void scull_mem_cleanup(void)
+{
+    void *data;
+
+    /* the trees still waiting to be freed go back to the caches first */
+    if (scull_wq)
+        destroy_workqueue(scull_wq);
+    scull_wq = NULL;
+    while ((data = scull_pool_get()))
+        scull_del_quantum(scull_cache_quantum, data);
+    kmem_cache_destroy(scull_quantum_cache);
+    kmem_cache_destroy(scull_data_cache);
+    kmem_cache_destroy(scull_qset_cache);
+    scull_quantum_cache = scull_data_cache = scull_qset_cache = NULL;
+}
+
+static int scull_mem_init(void)
+{
+    void *data;
+
+    scull_wq = alloc_workqueue("scull", WQ_UNBOUND, 0);
+    if (!scull_wq)
+        return -ENOMEM;
+    scull_cache_quantum = scull_quantum;
+    scull_cache_qset = scull_qset;
+    scull_qset_cache = KMEM_CACHE(scull_qset, 0);
+    scull_data_cache = kmem_cache_create("scull_data", scull_qset * sizeof(void *),
+                                         0, 0, NULL);
+    /* quanta are copied to and from user space */
+    if (scull_quantum % PAGE_SIZE)
+        scull_quantum_cache = kmem_cache_create_usercopy("scull_quantum", scull_quantum,
+                                                         0, 0, 0, scull_quantum, NULL);
+    if (!scull_qset_cache || !scull_data_cache ||
+        (scull_quantum % PAGE_SIZE && !scull_quantum_cache))
+        goto fail;
+
+    while (scull_pool_count < scull_pool)
+    {
+        data = scull_new_quantum(scull_cache_quantum);
+        if (!data)
+            goto fail;
+        scull_pool_put(data);
+    }
+    return 0;
+
+fail:
+    scull_mem_cleanup();
+    return -ENOMEM;
+}
+
+static struct scull_tree *scull_alloc_tree(int quantum, int qset)
+{
+    struct scull_tree *t = kmalloc(sizeof(*t), GFP_KERNEL);
+
+    if (!t)
+        return NULL;
+    xa_init(&t->qsets);
+    t->quantum = quantum;
+    t->qset = qset;
+    t->qshift = is_power_of_2(quantum) ? ilog2(quantum) : -1;
+    t->ishift = t->qshift >= 0 && is_power_of_2(qset) ? t->qshift + ilog2(qset) : -1;
+    t->cow = NULL;
+    t->memcg = NULL;
+    atomic_long_set(&t->zquanta, 0);
+    atomic_long_set(&t->zbytes, 0);
+    return t;
+}
+
+/*
+ * Free all the data in a tree, which is left empty.
+ */
+static void scull_empty_tree(struct scull_tree *t)
 {
-    struct scull_qset *next, *dptr;
-    int qset = dev->qset;
-    int i = 0;
+    struct scull_qset *dptr;
+    unsigned long index;
+    int i;
 
-    for (dptr = dev->data; dptr; dptr = next)
+    xa_for_each(&t->qsets, index, dptr)
     {
         if (dptr->data)
         {
-            for (i = 0; i < qset; i++)
+            for (i = 0; i < t->qset; i++)
             {
-                kfree(dptr->data[i]);
+                scull_free_quantum(t, dptr->data[i]);
             }
-            kfree(dptr->data);
-            dptr->data = NULL;
+            scull_free_data(t, dptr->data);
         }
-        next = dptr->next;
-        kfree(dptr);
+        kmem_cache_free(scull_qset_cache, dptr);
+    }
+    xa_destroy(&t->qsets);
+}
+
+static void scull_free_tree(struct scull_tree *t)
+{
+    scull_empty_tree(t);
+    if (t->cow && refcount_dec_and_test(&t->cow->ref))
+        kfree(t->cow);
+    mem_cgroup_put(t->memcg);
+    kfree(t);
+}
+
+static void scull_free_tree_work(struct work_struct *work)
+{
+    scull_free_tree(container_of(work, struct scull_tree, free_work));
+}
+
+/*
+ * Hand a tree nobody can reach any more to the workqueue.
+ */
+static void scull_free_tree_async(struct scull_tree *t)
+{
+    INIT_WORK(&t->free_work, scull_free_tree_work);
+    queue_work(scull_wq, &t->free_work);
+}
+
+/*
+ * The device keeps its geometry; only the data goes. The old tree is
+ * swapped for an empty one under the lock and freed later, so this
+ * takes the same time however much the device holds. If even an empty
+ * tree cannot be had, the data is freed in place. Mappings through
+ * mapping are zapped first: faults wait for the lock, so none can bring
+ * back a page of the old tree.
+ */
+int scull_trim(struct scull_dev *dev, struct address_space *mapping)
+{
+    struct scull_tree *old, *new;
+
+    if (down_write_killable(&dev->sem))
+        return -ERESTARTSYS;
+    unmap_mapping_range(mapping, 0, 0, 1);
+    old = dev->tree;
+    new = scull_alloc_tree(old->quantum, old->qset);
+    if (new)
+        dev->tree = new;
+    else
+        scull_empty_tree(old);
+    atomic64_set(&dev->size, 0);
+    up_write(&dev->sem);
+
+    if (new)
+        scull_free_tree_async(old);
+    return 0;
+}
+
+/*
+ * Note an access to a quantum set, for the compressor. Readers share
+ * the lock, so the store is skipped when it would change nothing.
+ */
+static void scull_touch(struct scull_qset *dptr)
+{
+    if (READ_ONCE(dptr->atime) != jiffies)
+        WRITE_ONCE(dptr->atime, jiffies);
+}
+
+/*
+ * Find quantum set n, adding it if missing. Writers to other sets may
+ * be adding theirs meanwhile, and one to the same set may beat us to
+ * it, in which case theirs is used.
+ */
+struct scull_qset *scull_follow(struct scull_tree *t, unsigned long n)
+{
+    struct scull_qset *qs = xa_load(&t->qsets, n);
+    struct scull_qset *old;
+
+    if (qs)
+        return qs;
+
+    qs = kmem_cache_zalloc(scull_qset_cache, GFP_KERNEL_ACCOUNT);
+    if (qs == NULL)
+        return NULL;
+    qs->atime = jiffies;
+    init_rwsem(&qs->sem);
+    old = xa_cmpxchg(&t->qsets, n, NULL, qs, GFP_KERNEL_ACCOUNT);
+    if (old)
+    {
+        kmem_cache_free(scull_qset_cache, qs);
+        return xa_is_err(old) ? NULL : old;
     }
-    dev->size = 0;
-    dev->quantum = scull_quantum;
-    dev->qset = scull_qset;
-    dev->data = NULL;
+    return qs;
+}
+
+static int scull_decompress(struct scull_tree *t, void *data, void *dst)
+{
+    struct scull_zquantum *zq = scull_zq(data);
+
+    if (LZ4_decompress_safe(zq->data, dst, zq->len, t->quantum) != t->quantum)
+        return -EIO;
     return 0;
 }
 
-struct scull_qset *scull_follow(struct scull_dev *dev, int n)
+/*
+ * Turn the compressed quantum in *slot back into a plain one, which the
+ * tree owns alone.
+ */
+static void *scull_inflate_quantum(struct scull_tree *t, void **slot)
+{
+    void *data = scull_alloc_quantum(t);
+
+    if (IS_ERR(data))
+        return data;
+    if (scull_decompress(t, *slot, data))
+    {
+        scull_free_quantum(t, data);
+        return ERR_PTR(-EIO);
+    }
+    scull_free_quantum(t, *slot);
+    *slot = data;
+    return data;
+}
+
+/*
+ * Compress the quantum in *slot, if that saves at least a quarter of
+ * it. buf holds t->quantum bytes. Shared quanta are left alone, as the
+ * other trees would keep the original anyway. The copy is charged to
+ * the tree's memcg rather than to the worker. Called with the quantum
+ * set locked for writing.
+ */
+static void scull_compress_quantum(struct scull_tree *t, void **slot,
+                                   void *buf, void *wrkmem)
+{
+    struct mem_cgroup *old;
+    struct scull_zquantum *zq;
+    int len;
+
+    if (!*slot || scull_is_compressed(*slot) || scull_is_shared(t, *slot))
+        return;
+    len = LZ4_compress_default(*slot, buf, t->quantum, t->quantum - t->quantum / 4, wrkmem);
+    if (len <= 0)
+        return;
+    old = set_active_memcg(t->memcg);
+    zq = kmalloc(struct_size(zq, data, len), GFP_KERNEL_ACCOUNT);
+    set_active_memcg(old);
+    if (!zq)
+        return;
+    zq->len = len;
+    memcpy(zq->data, buf, len);
+    scull_free_quantum(t, *slot);
+    /* no cap check: more than this was just given back */
+    atomic_long_add(len, &scull_bytes);
+    atomic_long_inc(&scull_quanta);
+    *slot = (void *)((unsigned long)zq | SCULL_ZTAG);
+    atomic_long_inc(&t->zquanta);
+    atomic_long_add(len, &t->zbytes);
+}
+
+/*
+ * Give the tree its own copy of the quantum in *slot if it shares it,
+ * so that it can be written to; a compressed one is inflated. A tree
+ * can only start sharing a quantum through a clone of itself, which
+ * holds dev->sem for writing, so a quantum seen unshared here by a
+ * writer (who holds it for reading) stays so. Called with the quantum
+ * set locked for writing.
+ */
+static void *scull_cow_quantum(struct scull_tree *t, void **slot)
+{
+    void *data;
+
+    if (scull_is_compressed(*slot))
+        return scull_inflate_quantum(t, slot);
+    if (!scull_is_shared(t, *slot))
+        return *slot;
+    data = scull_alloc_quantum(t);
+    if (IS_ERR(data))
+        return data;
+    memcpy(data, *slot, t->quantum);
+    if (!scull_unshare(t, *slot))
+    {
+        /* the others let go in the meantime: keep the original */
+        scull_free_quantum(t, data);
+        return *slot;
+    }
+    *slot = data;
+    return data;
+}
+
+/*
+ * Return quantum s_pos of the set, ready to be written to, allocating
+ * (or copying) whatever is missing on the way; an ERR_PTR() if that
+ * fails. Called with the set locked for writing, or on a tree nobody
+ * else can see.
+ */
+static void *scull_get_quantum(struct scull_tree *t, struct scull_qset *dptr, int s_pos)
+{
+    void *data;
+
+    scull_touch(dptr);
+    if (!dptr->data)
+    {
+        dptr->data = scull_alloc_data(t);
+        if (!dptr->data)
+            return ERR_PTR(-ENOMEM);
+    }
+    if (!dptr->data[s_pos])
+    {
+        data = scull_alloc_quantum(t);
+        if (IS_ERR(data))
+            return data;
+        dptr->data[s_pos] = data;
+    }
+    return scull_cow_quantum(t, &dptr->data[s_pos]);
+}
+
+/*
+ * Like scull_get_quantum(), but never allocates: enough with the set
+ * locked for reading. What comes back may be shared, or compressed.
+ */
+static void *scull_find_quantum(struct scull_qset *dptr, int s_pos)
+{
+    if (!dptr->data)
+        return NULL;
+    scull_touch(dptr);
+    return dptr->data[s_pos];
+}
+
+/*
+ * Find quantum set item, adding it unless nowait, and lock it for
+ * writing. Called with dev->sem held for reading.
+ */
+static struct scull_qset *scull_lock_qset(struct scull_dev *dev, struct scull_tree *t,
+                                          unsigned long item, bool nowait)
+{
+    struct scull_qset *dptr;
+
+    dptr = nowait ? xa_load(&t->qsets, item) : scull_follow(t, item);
+    if (!dptr)
+        return ERR_PTR(nowait ? -EAGAIN : -ENOMEM);
+    if (down_write_trylock(&dptr->sem))
+        return dptr;
+    scull_stats_contended(&dev->stats);
+    if (nowait)
+        return ERR_PTR(-EAGAIN);
+    down_write(&dptr->sem);
+    return dptr;
+}
+
+/*
+ * Grow the device to end, if it is not that large already. Writers
+ * share dev->sem, so they may be at it together.
+ */
+static void scull_grow(struct scull_dev *dev, loff_t end)
 {
-    struct scull_qset *qs = dev->data;
+    s64 size = atomic64_read(&dev->size);
+
+    while (size < end && !atomic64_try_cmpxchg(&dev->size, &size, end))
+        ;
+}
 
-    if (!qs)
+/*
+ * Split a device offset into quantum set, quantum and offset in quantum.
+ * This is on every path through the device, so power-of-two geometries
+ * get shifts and masks instead of 64-bit divisions.
+ */
+static void scull_locate(struct scull_tree *t, loff_t pos,
+                         unsigned long *item, int *s_pos, int *q_pos)
+{
+    u64 rest;
+    u32 rem;
+
+    if (t->ishift >= 0)
+    {
+        *item = pos >> t->ishift;
+        rest = pos & ((1ULL << t->ishift) - 1);
+    }
+    else
     {
-        qs = dev->data = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-        if (qs == NULL)
-            return NULL;
-        memset(qs, 0, sizeof(struct scull_qset));
+        *item = div64_u64_rem(pos, (u64)t->quantum * t->qset, &rest);
     }
 
-    while (n--)
+    if (t->qshift >= 0)
     {
-        if (!qs->next)
+        *s_pos = rest >> t->qshift;
+        *q_pos = rest & (t->quantum - 1);
+    }
+    else
+    {
+        *s_pos = div_u64_rem(rest, t->quantum, &rem);
+        *q_pos = rem;
+    }
+}
+
+/*
+ * Find the first offset at or after "off" that is data (or a hole).
+ * Missing quantum sets are skipped as a whole, so large sparse devices
+ * are cheap to walk. The end of the device counts as a hole.
+ */
+static loff_t scull_seek_hole_data(struct scull_dev *dev, loff_t off, int whence)
+{
+    struct scull_qset *dptr;
+    struct scull_tree *t;
+    unsigned long item;
+    int s_pos, q_pos;
+    unsigned long index;
+    loff_t pos = off, size;
+    bool empty = true, hole = true;
+
+    if (down_read_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+
+    t = dev->tree;
+    size = atomic64_read(&dev->size);
+    while (pos < size)
+    {
+        scull_locate(t, pos, &item, &s_pos, &q_pos);
+        dptr = xa_load(&t->qsets, item);
+        if (dptr)
+        {
+            down_read(&dptr->sem);
+            empty = !dptr->data;
+            hole = empty || !dptr->data[s_pos];
+            up_read(&dptr->sem);
+        }
+        if (!dptr || empty)
         {
-            qs->next = kmalloc(sizeof(struct scull_qset), GFP_KERNEL);
-            if (qs->next == NULL)
-                return NULL;
-            memset(qs->next, 0, sizeof(struct scull_qset));
+            if (whence == SEEK_HOLE)
+                goto out;
+            index = item;
+            if (!xa_find_after(&t->qsets, &index, ULONG_MAX, XA_PRESENT))
+                break;
+            pos = (loff_t)index * t->quantum * t->qset;
+            continue;
         }
-        qs = qs->next;
-        continue;
+        if (hole == (whence == SEEK_HOLE))
+            goto out;
+        pos += t->quantum - q_pos;
     }
-    return qs;
+    pos = whence == SEEK_HOLE ? size : -ENXIO;
+
+out:
+    up_read(&dev->sem);
+    return pos;
 }
 
 loff_t scull_llseek(struct file *filp, loff_t off, int whence)
 {
-    printk(KERN_ALERT "scull_llseek\n");
-
     struct scull_dev *dev = filp->private_data;
     loff_t newpos;
     switch (whence)
@@ -98,127 +832,529 @@ loff_t scull_llseek(struct file *filp, loff_t off, int whence)
         newpos = filp->f_pos + off;
         break;
     case 2: 
-        newpos = dev->size + off;
+        newpos = atomic64_read(&dev->size) + off;
+        break;
+    case SEEK_DATA:
+    case SEEK_HOLE:
+        if (off < 0 || off >= atomic64_read(&dev->size))
+            newpos = -ENXIO;
+        else
+            newpos = scull_seek_hole_data(dev, off, whence);
         break;
     default: 
-        return -EINVAL;
+        newpos = -EINVAL;
     }
-    if (newpos < 0)
-        return -EINVAL;
-    filp->f_pos = newpos;
-    return newpos;
+    if (newpos >= 0)
+        filp->f_pos = newpos;
+    else if (newpos != -ENXIO && newpos != -ERESTARTSYS)
+        newpos = -EINVAL;
 
-    return 0;
+    trace_scull_llseek(iminor(file_inode(filp)), off, whence, newpos);
+    return newpos;
 }
 
-ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Data is moved one quantum at a time, but all the quanta covered by
+ * the request are handled under a single acquisition of the semaphore.
+ * Readers only take it shared, so they proceed in parallel.
+ *
+ * The user buffer may be a mapping of this very device, whose faults
+ * take the same locks, so the copies are done with page faults off. A
+ * short copy drops the locks, faults the rest of the chunk in and goes
+ * on from there, as filemap does.
+ */
+static ssize_t scull_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
 {
-    printk(KERN_ALERT "scull_read\n");
-
-    struct scull_dev *dev = filp->private_data;
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
     struct scull_qset *dptr;
-    int quantum = dev->quantum;
-    int itemsize = quantum * dev->qset;
-    int qset = dev->qset;
-    int item, s_pos, q_pos, rest;
+    struct scull_tree *t;
+    void *data, *bounce = NULL;
+    int bsize = 0;
+    loff_t pos = iocb->ki_pos, size;
+    unsigned long item;
+    int s_pos, q_pos, err = 0;
+    size_t count, chunk, copied = 0;
     ssize_t retval = 0;
 
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    if (!down_read_trylock(&dev->sem))
+    {
+        scull_stats_contended(&dev->stats);
+        if (nowait)
+            return -EAGAIN;
+        if (down_read_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+    }
 
-    if (*f_pos >= dev->size)
-        goto out;
-    if (*f_pos + count > dev->size)
-        count = dev->size - *f_pos;
+    t = dev->tree;
+    size = atomic64_read(&dev->size);
+    count = pos < size ? min_t(loff_t, iov_iter_count(to), size - pos) : 0;
+    while (count)
+    {
+        scull_locate(t, pos, &item, &s_pos, &q_pos);
+        chunk = min_t(size_t, count, t->quantum - q_pos);
 
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+        dptr = xa_load(&t->qsets, item);
+        if (dptr && !down_read_trylock(&dptr->sem))
+        {
+            scull_stats_contended(&dev->stats);
+            if (nowait)
+            {
+                err = -EAGAIN;
+                break;
+            }
+            down_read(&dptr->sem);
+        }
 
-    dptr = scull_follow(dev, item);
+        /* holes read as zeros */
+        data = dptr ? scull_find_quantum(dptr, s_pos) : NULL;
 
-    if (dptr == NULL || !dptr->data || !dptr->data[s_pos])
-        goto out;
+        /*
+         * A compressed quantum that is read is in use again, so it is
+         * inflated in place, with the set taken exclusively for that.
+         * Should that fail, or not be allowed to wait, it is read
+         * through a buffer of this call's own.
+         */
+        if (data && scull_is_compressed(data) && !nowait)
+        {
+            up_read(&dptr->sem);
+            down_write(&dptr->sem);
+            data = scull_find_quantum(dptr, s_pos);
+            if (data && scull_is_compressed(data) &&
+                !IS_ERR(scull_inflate_quantum(t, &dptr->data[s_pos])))
+                data = dptr->data[s_pos];
+            downgrade_write(&dptr->sem);
+        }
+        if (data && scull_is_compressed(data))
+        {
+            /* the tree, and its quantum, may have changed since */
+            if (bsize != t->quantum)
+            {
+                kfree(bounce);
+                bounce = kmalloc(t->quantum, nowait ? GFP_NOWAIT : GFP_KERNEL);
+                bsize = bounce ? t->quantum : 0;
+            }
+            if (!bounce)
+                err = nowait ? -EAGAIN : -ENOMEM;
+            else
+                err = scull_decompress(t, data, bounce);
+            data = bounce;
+        }
+        if (!err)
+        {
+            pagefault_disable();
+            if (data)
+                copied = copy_to_iter(data + q_pos, chunk, to);
+            else
+                copied = iov_iter_zero(chunk, to);
+            pagefault_enable();
+        }
+        if (dptr)
+            up_read(&dptr->sem);
+        if (err)
+            break;
+
+        pos += copied;
+        count -= copied;
+        retval += copied;
+        if (copied == chunk)
+            continue;
+
+        up_read(&dev->sem);
+        if (nowait)
+            err = -EAGAIN;
+        else if (fault_in_iov_iter_writeable(to, chunk - copied) == chunk - copied)
+            err = -EFAULT;
+        else if (down_read_interruptible(&dev->sem))
+            err = -ERESTARTSYS;
+        if (err)
+            goto unlocked;
+        t = dev->tree;
+        size = atomic64_read(&dev->size);
+        count = pos < size ? min_t(loff_t, iov_iter_count(to), size - pos) : 0;
+    }
+    up_read(&dev->sem);
+
+unlocked:
+    iocb->ki_pos = pos;
+    if (!retval)
+        retval = err;
+    kfree(bounce);
+    return retval;
+}
 
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+/*
+ * Writers share dev->sem and lock only the quantum set they are in, so
+ * writers to different sets go ahead together, allocation included.
+ * Copies are made with page faults off, as for reading.
+ */
+static ssize_t scull_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    struct scull_qset *dptr;
+    struct scull_tree *t;
+    void *data;
+    loff_t pos = iocb->ki_pos;
+    unsigned long item;
+    int s_pos, q_pos, err = 0;
+    size_t chunk, copied;
+    ssize_t retval = 0;
+    bool fresh;
 
-    if (copy_to_user(buf, dptr->data[s_pos] + q_pos, count))
+    if (!down_read_trylock(&dev->sem))
     {
-        retval = -EFAULT;
-        goto out;
+        scull_stats_contended(&dev->stats);
+        if (nowait)
+            return -EAGAIN;
+        if (down_read_killable(&dev->sem))
+            return -ERESTARTSYS;
     }
 
-    *f_pos += count;
-    retval = count;
+    t = dev->tree;
+    while (iov_iter_count(from))
+    {
+        scull_locate(t, pos, &item, &s_pos, &q_pos);
+        fresh = false;
+
+        /* allocating may sleep: IOCB_NOWAIT only writes what is there */
+        dptr = scull_lock_qset(dev, t, item, nowait);
+        if (IS_ERR(dptr))
+            data = ERR_CAST(dptr);
+        else if (!nowait)
+        {
+            fresh = !dptr->data || !dptr->data[s_pos];
+            data = scull_get_quantum(t, dptr, s_pos);
+        }
+        else if (!(data = scull_find_quantum(dptr, s_pos)) ||
+                 scull_is_compressed(data) || scull_is_shared(t, data))
+            data = ERR_PTR(-EAGAIN);
+        if (IS_ERR(data))
+        {
+            if (!IS_ERR(dptr))
+                up_write(&dptr->sem);
+            err = PTR_ERR(data);
+            break;
+        }
 
-out:
-    up(&dev->sem);
+        chunk = min_t(size_t, iov_iter_count(from), t->quantum - q_pos);
+        pagefault_disable();
+        copied = copy_from_iter(data + q_pos, chunk, from);
+        pagefault_enable();
+
+        /*
+         * A whole quantum of zeros reads back the same as a hole, so it
+         * goes back to the pool; writing there later allocates afresh.
+         * Not while mapped, as the mappings would keep the old page. A
+         * new quantum given only some zeros is left to the shrinker.
+         * Fallocated sets keep their quanta either way.
+         */
+        if (copied && !nowait && !dptr->prealloc && !memchr_inv(data + q_pos, 0, copied))
+        {
+            if (copied == t->quantum && !atomic_read(&dev->mapped))
+            {
+                scull_free_quantum(t, data);
+                dptr->data[s_pos] = NULL;
+            }
+            else if (fresh)
+                atomic_long_inc(&scull_zero_hint);
+        }
+        up_write(&dptr->sem);
+
+        pos += copied;
+        retval += copied;
+        if (copied == chunk)
+            continue;
+
+        if (retval > 0)
+            scull_grow(dev, pos);
+        up_read(&dev->sem);
+        if (nowait)
+            err = -EAGAIN;
+        else if (fault_in_iov_iter_readable(from, chunk - copied) == chunk - copied)
+            err = -EFAULT;
+        else if (down_read_killable(&dev->sem))
+            err = -ERESTARTSYS;
+        if (err)
+            goto unlocked;
+        t = dev->tree;
+    }
+    /* a write that moved nothing leaves the size alone */
+    if (retval > 0)
+        scull_grow(dev, pos);
+    up_read(&dev->sem);
+
+unlocked:
+    iocb->ki_pos = pos;
+    if (!retval)
+        retval = err;
+    return retval;
+}
+
+/*
+ * One clock read per call feeds both the statistics and the tracepoint.
+ */
+ssize_t scull_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(to);
+    u64 start = local_clock();
+    ssize_t retval;
+
+    retval = scull_do_read_iter(iocb, to);
+    scull_stats_account(&dev->stats, SCULL_STAT_READ, retval, start);
+    if (trace_scull_read_enabled())
+        trace_scull_read(iminor(file_inode(iocb->ki_filp)), pos, count,
+                         retval, local_clock() - start);
+    return retval;
+}
+
+ssize_t scull_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct scull_dev *dev = iocb->ki_filp->private_data;
+    loff_t pos = iocb->ki_pos;
+    size_t count = iov_iter_count(from);
+    u64 start = local_clock();
+    ssize_t retval;
+
+    retval = scull_do_write_iter(iocb, from);
+    scull_stats_account(&dev->stats, SCULL_STAT_WRITE, retval, start);
+    if (trace_scull_write_enabled())
+        trace_scull_write(iminor(file_inode(iocb->ki_filp)), pos, count,
+                          retval, local_clock() - start);
+    return retval;
+}
+
+ssize_t scull_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+{
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    ssize_t retval;
+
+    init_sync_kiocb(&kiocb, filp);
+    kiocb.ki_pos = *f_pos;
+    iov_iter_ubuf(&iter, ITER_DEST, buf, count);
+    retval = scull_read_iter(&kiocb, &iter);
+    *f_pos = kiocb.ki_pos;
     return retval;
 }
 
 ssize_t scull_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
 {
-    printk(KERN_ALERT "scull_write\n");
+    struct kiocb kiocb;
+    struct iov_iter iter;
+    ssize_t retval;
+
+    init_sync_kiocb(&kiocb, filp);
+    kiocb.ki_pos = *f_pos;
+    iov_iter_ubuf(&iter, ITER_SOURCE, (void __user *)buf, count);
+    retval = scull_write_iter(&kiocb, &iter);
+    *f_pos = kiocb.ki_pos;
+    return retval;
+}
 
-    struct scull_dev *dev = filp->private_data;
-    struct scull_qset *dptr;
-    int quantum = dev->quantum, qset = dev->qset;
-    int itemsize = quantum * qset;
-    int item, s_pos, q_pos, rest;
-    ssize_t retval = -ENOMEM;
+/*
+ * Exchange the geometry of a device: *quantum and *qset are the new
+ * values (0 keeps the current one) and get the old ones back. The data
+ * is copied over into a tree with the new layout, holes staying holes.
+ * That is refused while the device is mapped, as the mappings point
+ * into the old quanta.
+ */
+static int scull_geometry(struct scull_dev *dev, int *quantum, int *qset)
+{
+    struct scull_tree *old, *new;
+    struct scull_qset *dptr, *qs;
+    unsigned long index;
+    unsigned long item;
+    int s_pos, q_pos, i;
+    int nquantum, nqset;
+    loff_t pos, end;
+    size_t chunk;
+    void *data, *dst;
+    int retval = 0;
 
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    if (*quantum < 0 || *quantum > KMALLOC_MAX_SIZE ||
+        *qset < 0 || *qset > KMALLOC_MAX_SIZE / sizeof(void *))
+        return -EINVAL;
+
+    if (!*quantum && !*qset)
+    {
+        if (down_read_interruptible(&dev->sem))
+            return -ERESTARTSYS;
+        *quantum = dev->tree->quantum;
+        *qset = dev->tree->qset;
+        up_read(&dev->sem);
+        return 0;
+    }
 
-    item = (long)*f_pos / itemsize;
-    rest = (long)*f_pos % itemsize;
-    s_pos = rest / quantum;
-    q_pos = rest % quantum;
+    if (down_write_killable(&dev->sem))
+        return -ERESTARTSYS;
 
-    dptr = scull_follow(dev, item);
-    if (dptr == NULL)
+    old = dev->tree;
+    nquantum = *quantum ? *quantum : old->quantum;
+    nqset = *qset ? *qset : old->qset;
+    if (nquantum == old->quantum && nqset == old->qset)
         goto out;
-    if (!dptr->data)
+    if (atomic_read(&dev->mapped))
     {
-        dptr->data = kmalloc(qset * sizeof(char *), GFP_KERNEL);
-        if (!dptr->data)
-            goto out;
-        memset(dptr->data, 0, qset * sizeof(char *));
+        retval = -EBUSY;
+        goto out;
     }
-    if (!dptr->data[s_pos])
+
+    new = scull_alloc_tree(nquantum, nqset);
+    if (!new)
     {
-        dptr->data[s_pos] = kmalloc(quantum, GFP_KERNEL);
-        if (!dptr->data[s_pos])
-            goto out;
+        retval = -ENOMEM;
+        goto out;
+    }
+    xa_for_each(&old->qsets, index, dptr)
+    {
+        for (i = 0; dptr->data && i < old->qset; i++)
+        {
+            if (!dptr->data[i])
+                continue;
+            if (scull_is_compressed(dptr->data[i]))
+            {
+                data = scull_inflate_quantum(old, &dptr->data[i]);
+                if (IS_ERR(data))
+                {
+                    scull_free_tree(new);
+                    retval = PTR_ERR(data);
+                    goto out;
+                }
+            }
+            /* whole quanta: those past the end may have been fallocated */
+            pos = ((loff_t)index * old->qset + i) * old->quantum;
+            end = pos + old->quantum;
+            for (data = dptr->data[i]; pos < end; pos += chunk, data += chunk)
+            {
+                scull_locate(new, pos, &item, &s_pos, &q_pos);
+                chunk = min_t(loff_t, end - pos, new->quantum - q_pos);
+                qs = scull_follow(new, item);
+                dst = qs ? scull_get_quantum(new, qs, s_pos) : ERR_PTR(-ENOMEM);
+                if (IS_ERR(dst))
+                {
+                    scull_free_tree(new);
+                    retval = PTR_ERR(dst);
+                    goto out;
+                }
+                qs->prealloc |= dptr->prealloc;
+                memcpy(dst + q_pos, data, chunk);
+            }
+        }
     }
+    dev->tree = new;
+    *quantum = old->quantum;
+    *qset = old->qset;
+    up_write(&dev->sem);
+    scull_free_tree_async(old);
+    return 0;
+
+out:
+    *quantum = old->quantum;
+    *qset = old->qset;
+    up_write(&dev->sem);
+    return retval;
+}
 
-    if (count > quantum - q_pos)
-        count = quantum - q_pos;
+/*
+ * Make dst a copy of src that shares all of its quanta: only the
+ * quantum sets are duplicated, and either device copies a quantum the
+ * first time it writes to it. Neither may be mapped, since stores
+ * through a mapping would go straight into the shared quanta.
+ */
+static int scull_clone(struct scull_dev *dst, struct scull_dev *src)
+{
+    struct scull_dev *first = dst < src ? dst : src;
+    struct scull_dev *second = dst < src ? src : dst;
+    struct scull_tree *t, *new, *old = NULL;
+    struct scull_qset *dptr, *qs;
+    unsigned long index;
+    int i, retval = 0;
+
+    /*
+     * Writers only share dev->sem, so the source is locked exclusively
+     * too; two clones crossing each other take the locks in the same
+     * order.
+     */
+    if (down_write_killable(&first->sem))
+        return -ERESTARTSYS;
+    down_write_nested(&second->sem, SINGLE_DEPTH_NESTING);
 
-    if (copy_from_user(dptr->data[s_pos] + q_pos, buf, count))
+    if (atomic_read(&src->mapped) || atomic_read(&dst->mapped))
     {
-        retval = -EFAULT;
+        retval = -EBUSY;
         goto out;
     }
-    *f_pos += count;
-    retval = count;
-
-    if (dev->size < *f_pos)
-        dev->size = *f_pos;
+    t = src->tree;
+    if (!t->cow)
+    {
+        t->cow = kzalloc(sizeof(*t->cow), GFP_KERNEL);
+        if (!t->cow)
+        {
+            retval = -ENOMEM;
+            goto out;
+        }
+        refcount_set(&t->cow->ref, 1);
+    }
+    new = scull_alloc_tree(t->quantum, t->qset);
+    if (!new)
+    {
+        retval = -ENOMEM;
+        goto out;
+    }
+    refcount_inc(&t->cow->ref);
+    new->cow = t->cow;
+    xa_for_each(&t->qsets, index, dptr)
+    {
+        if (!dptr->data)
+            continue;
+        qs = scull_follow(new, index);
+        if (qs)
+            qs->data = scull_alloc_data(new);
+        if (!qs || !qs->data)
+        {
+            retval = -ENOMEM;
+            goto fail;
+        }
+        qs->prealloc = dptr->prealloc;
+        for (i = 0; i < t->qset; i++)
+        {
+            if (!dptr->data[i])
+                continue;
+            retval = scull_share(t, dptr->data[i]);
+            if (retval)
+                goto fail;
+            qs->data[i] = dptr->data[i];
+            if (scull_is_compressed(qs->data[i]))
+            {
+                atomic_long_inc(&new->zquanta);
+                atomic_long_add(scull_zq(qs->data[i])->len, &new->zbytes);
+            }
+        }
+    }
+    old = dst->tree;
+    dst->tree = new;
+    atomic64_set(&dst->size, atomic64_read(&src->size));
+    goto out;
 
+fail:
+    scull_free_tree(new);
 out:
-    up(&dev->sem);
+    up_write(&dst->sem);
+    up_write(&src->sem);
+    if (old)
+        scull_free_tree_async(old);
     return retval;
 }
 
-long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+static long scull_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
 {
-    printk(KERN_ALERT "scull_ioctl\n");
-
+    struct scull_dev *dev = filp->private_data;
+    struct scull_falloc fa;
+    int quantum = 0, qset = 0;
     int err = 0;
-    int tmp;
     int retval = 0;
 
     if (_IOC_TYPE(cmd) != SCULL_IOC_MAGIC)
@@ -236,79 +1372,122 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     switch (cmd)
     {
     case SCULL_IOCRESET:
-        scull_quantum = SCULL_QUANTUM;
-        scull_qset = SCULL_QSET;
-        break;
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        quantum = scull_quantum;
+        qset = scull_qset;
+        return scull_geometry(dev, &quantum, &qset);
 
     case SCULL_IOCSQUANTUM: /* Set: arg points to the value */
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        retval = __get_user(scull_quantum, (int __user *)arg);
+        retval = __get_user(quantum, (int __user *)arg);
+        if (retval == 0)
+            retval = scull_geometry(dev, &quantum, &qset);
         break;
 
     case SCULL_IOCTQUANTUM: /* Tell: arg is the value */
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        scull_quantum = arg;
-        break;
+        quantum = arg;
+        return scull_geometry(dev, &quantum, &qset);
 
     case SCULL_IOCGQUANTUM: /* Get: arg is pointer to result */
-        retval = __put_user(scull_quantum, (int __user *)arg);
+        retval = scull_geometry(dev, &quantum, &qset);
+        if (retval == 0)
+            retval = __put_user(quantum, (int __user *)arg);
         break;
 
     case SCULL_IOCQQUANTUM: /* Query: return it (it's positive) */
-        return scull_quantum;
+        retval = scull_geometry(dev, &quantum, &qset);
+        return retval ? retval : quantum;
 
     case SCULL_IOCXQUANTUM: /* eXchange: use arg as pointer */
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        tmp = scull_quantum;
-        retval = __get_user(scull_quantum, (int __user *)arg);
+        retval = __get_user(quantum, (int __user *)arg);
+        if (retval == 0)
+            retval = scull_geometry(dev, &quantum, &qset);
         if (retval == 0)
-            retval = __put_user(tmp, (int __user *)arg);
+            retval = __put_user(quantum, (int __user *)arg);
         break;
 
     case SCULL_IOCHQUANTUM: /* sHift: like Tell + Query */
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        tmp = scull_quantum;
-        scull_quantum = arg;
-        return tmp;
+        quantum = arg;
+        retval = scull_geometry(dev, &quantum, &qset);
+        return retval ? retval : quantum;
 
     case SCULL_IOCSQSET:
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        retval = __get_user(scull_qset, (int __user *)arg);
+        retval = __get_user(qset, (int __user *)arg);
+        if (retval == 0)
+            retval = scull_geometry(dev, &quantum, &qset);
         break;
 
     case SCULL_IOCTQSET:
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        scull_qset = arg;
-        break;
+        qset = arg;
+        return scull_geometry(dev, &quantum, &qset);
 
     case SCULL_IOCGQSET:
-        retval = __put_user(scull_qset, (int __user *)arg);
+        retval = scull_geometry(dev, &quantum, &qset);
+        if (retval == 0)
+            retval = __put_user(qset, (int __user *)arg);
         break;
 
     case SCULL_IOCQQSET:
-        return scull_qset;
+        retval = scull_geometry(dev, &quantum, &qset);
+        return retval ? retval : qset;
 
     case SCULL_IOCXQSET:
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        tmp = scull_qset;
-        retval = __get_user(scull_qset, (int __user *)arg);
+        retval = __get_user(qset, (int __user *)arg);
+        if (retval == 0)
+            retval = scull_geometry(dev, &quantum, &qset);
         if (retval == 0)
-            retval = put_user(tmp, (int __user *)arg);
+            retval = put_user(qset, (int __user *)arg);
         break;
 
     case SCULL_IOCHQSET:
         if (!capable(CAP_SYS_ADMIN))
             return -EPERM;
-        tmp = scull_qset;
-        scull_qset = arg;
-        return tmp;
+        qset = arg;
+        retval = scull_geometry(dev, &quantum, &qset);
+        return retval ? retval : qset;
+
+    case SCULL_IOCSTATRESET:
+        scull_stats_reset(&dev->stats);
+        break;
+
+    case SCULL_IOCFALLOCATE:
+        if (!(filp->f_mode & FMODE_WRITE))
+            return -EBADF;
+        if (copy_from_user(&fa, (void __user *)arg, sizeof(fa)))
+            return -EFAULT;
+        return scull_fallocate(filp, fa.mode, fa.offset, fa.len);
+
+    case SCULL_IOCCLONE:
+    {
+        struct fd src = fdget(arg);
+
+        if (!src.file)
+            return -EBADF;
+        if (!(filp->f_mode & FMODE_WRITE) || !(src.file->f_mode & FMODE_READ))
+            retval = -EBADF;
+        else if (src.file->f_op != &scull_fops)
+            retval = -EINVAL;
+        else if (src.file->private_data == dev)
+            retval = -EINVAL;
+        else
+            retval = scull_clone(dev, src.file->private_data);
+        fdput(src);
+        return retval;
+    }
 
     default:
         return -ENOTTY;
@@ -317,41 +1496,530 @@ long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
     return retval;
 }
 
-int scull_open(struct inode *inode, struct file *filp)
+long scull_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_dev *dev = filp->private_data;
+    u64 start = local_clock();
+    long retval;
+
+    retval = scull_do_ioctl(filp, cmd, arg);
+    scull_stats_account(&dev->stats, SCULL_STAT_IOCTL, retval, start);
+    if (trace_scull_ioctl_enabled())
+        trace_scull_ioctl(iminor(file_inode(filp)), cmd, arg, retval,
+                          local_clock() - start);
+    return retval;
+}
+
+/*
+ * Pages that are already there are mapped with their quantum set
+ * locked shared; only faults that allocate or copy lock it exclusively.
+ */
+static vm_fault_t scull_vma_fault(struct vm_fault *vmf)
+{
+    struct scull_dev *dev = vmf->vma->vm_private_data;
+    loff_t off = (loff_t)vmf->pgoff << PAGE_SHIFT;
+    /* a write to a private mapping goes to a copy, not the device */
+    bool write = (vmf->flags & FAULT_FLAG_WRITE) && (vmf->vma->vm_flags & VM_SHARED);
+    struct scull_qset *dptr;
+    struct scull_tree *t;
+    unsigned long item;
+    int s_pos, q_pos;
+    vm_fault_t ret = 0;
+    void *data;
+
+    down_read(&dev->sem);
+    if (off >= atomic64_read(&dev->size) && !write)
+    {
+        ret = VM_FAULT_SIGBUS;
+        goto out;
+    }
+    t = dev->tree;
+    scull_locate(t, off, &item, &s_pos, &q_pos);
+    dptr = scull_follow(t, item);
+    if (!dptr)
+    {
+        ret = VM_FAULT_OOM;
+        goto out;
+    }
+
+    down_read(&dptr->sem);
+    data = scull_find_quantum(dptr, s_pos);
+    /* a shared quantum is copied first, mapping it could write to it */
+    if (data && !scull_is_compressed(data) && !scull_is_shared(t, data))
+        goto map;
+    up_read(&dptr->sem);
+
+    down_write(&dptr->sem);
+    if (!data && !dptr->prealloc)
+        atomic_long_inc(&scull_zero_hint);
+    data = scull_get_quantum(t, dptr, s_pos);
+    if (IS_ERR(data))
+    {
+        up_write(&dptr->sem);
+        ret = PTR_ERR(data) == -ENOSPC ? VM_FAULT_SIGBUS : VM_FAULT_OOM;
+        goto out;
+    }
+    downgrade_write(&dptr->sem);
+
+map:
+    vmf->page = virt_to_page(data + q_pos);
+    get_page(vmf->page);
+    up_read(&dptr->sem);
+    if (write)
+        scull_grow(dev, off + PAGE_SIZE);
+out:
+    up_read(&dev->sem);
+    return ret;
+}
+
+/*
+ * Mappings are counted so that the geometry, which they depend on,
+ * stays put while there are any.
+ */
+static void scull_vma_open(struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = vma->vm_private_data;
+
+    atomic_inc(&dev->mapped);
+}
+
+static void scull_vma_close(struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = vma->vm_private_data;
+
+    atomic_dec(&dev->mapped);
+}
+
+static const struct vm_operations_struct scull_vm_ops = {
+    .open = scull_vma_open,
+    .close = scull_vma_close,
+    .fault = scull_vma_fault,
+};
+
+int scull_mmap(struct file *filp, struct vm_area_struct *vma)
+{
+    struct scull_dev *dev = filp->private_data;
+
+    if (down_read_interruptible(&dev->sem))
+        return -ERESTARTSYS;
+    if (dev->tree->quantum % PAGE_SIZE)
+    {
+        up_read(&dev->sem);
+        return -EINVAL;
+    }
+    atomic_inc(&dev->mapped);
+    up_read(&dev->sem);
+
+    vma->vm_ops = &scull_vm_ops;
+    vma->vm_private_data = dev;
+    vm_flags_set(vma, VM_DONTEXPAND | VM_DONTDUMP);
+    return 0;
+}
+
+/*
+ * Free the quanta entirely inside [offset, end) and zero the covered
+ * part of the others; quantum sets left empty go away altogether.
+ * User mappings of the range are torn down first. Called with dev->sem
+ * held for writing.
+ */
+static int scull_punch_hole(struct scull_dev *dev, struct file *filp,
+                            loff_t offset, loff_t end)
+{
+    struct scull_tree *t = dev->tree;
+    u64 itemsize = (u64)t->quantum * t->qset;
+    unsigned long index, first, last, item;
+    struct scull_qset *dptr;
+    loff_t qstart, pos, to;
+    int s_pos, q_pos, i;
+    size_t chunk;
+    void *data;
+
+    unmap_mapping_range(filp->f_mapping, offset, end - offset, 1);
+
+    scull_locate(t, offset, &first, &s_pos, &q_pos);
+    scull_locate(t, end - 1, &last, &s_pos, &q_pos);
+    xa_for_each_range(&t->qsets, index, dptr, first, last)
+    {
+        if (dptr->data)
+        {
+            qstart = (loff_t)index * itemsize;
+            to = min_t(loff_t, end, qstart + itemsize);
+            for (pos = max(offset, qstart); pos < to; pos += chunk)
+            {
+                scull_locate(t, pos, &item, &s_pos, &q_pos);
+                chunk = min_t(loff_t, to - pos, t->quantum - q_pos);
+                data = dptr->data[s_pos];
+                if (!data)
+                    continue;
+                if (chunk == t->quantum)
+                {
+                    scull_free_quantum(t, data);
+                    dptr->data[s_pos] = NULL;
+                }
+                else
+                {
+                    data = scull_cow_quantum(t, &dptr->data[s_pos]);
+                    if (IS_ERR(data))
+                        return PTR_ERR(data);
+                    memset(data + q_pos, 0, chunk);
+                    if (!dptr->prealloc)
+                        atomic_long_inc(&scull_zero_hint);
+                }
+            }
+            for (i = 0; i < t->qset; i++)
+                if (dptr->data[i])
+                    break;
+            if (i < t->qset)
+                continue;
+            scull_free_data(t, dptr->data);
+        }
+        xa_erase(&t->qsets, index);
+        kmem_cache_free(scull_qset_cache, dptr);
+    }
+    return 0;
+}
+
+/*
+ * Allocate everything backing [offset, offset + len), so that writes
+ * there later do not have to. Without FALLOC_FL_KEEP_SIZE the device
+ * grows to cover the range, as a regular file would.
+ * FALLOC_FL_PUNCH_HOLE (with FALLOC_FL_KEEP_SIZE, as usual) frees the
+ * backing instead, and the range then reads as zeros. The VFS does not
+ * pass fallocate(2) on to character devices, so in practice this is
+ * reached through SCULL_IOCFALLOCATE.
+ */
+long scull_fallocate(struct file *filp, int mode, loff_t offset, loff_t len)
 {
-    printk(KERN_ALERT "scull_open\n");
+    struct scull_dev *dev = filp->private_data;
+    struct scull_qset *dptr;
+    struct scull_tree *t;
+    unsigned long item;
+    int s_pos, q_pos;
+    loff_t pos, end;
+    long retval = 0;
+    void *data;
+
+    if (mode & ~(FALLOC_FL_KEEP_SIZE | FALLOC_FL_PUNCH_HOLE))
+        return -EOPNOTSUPP;
+    if ((mode & FALLOC_FL_PUNCH_HOLE) && !(mode & FALLOC_FL_KEEP_SIZE))
+        return -EOPNOTSUPP;
+    if (offset < 0 || len <= 0)
+        return -EINVAL;
+    if (check_add_overflow(offset, len, &end))
+        return -EFBIG;
 
+    /* punching removes quantum sets, which takes the whole device */
+    if (mode & FALLOC_FL_PUNCH_HOLE)
+    {
+        if (down_write_killable(&dev->sem))
+            return -ERESTARTSYS;
+        retval = scull_punch_hole(dev, filp, offset, end);
+        up_write(&dev->sem);
+        return retval;
+    }
+
+    if (down_read_killable(&dev->sem))
+        return -ERESTARTSYS;
+
+    t = dev->tree;
+    for (pos = offset; pos < end; pos += t->quantum - q_pos)
+    {
+        scull_locate(t, pos, &item, &s_pos, &q_pos);
+        dptr = scull_lock_qset(dev, t, item, false);
+        if (IS_ERR(dptr))
+        {
+            retval = PTR_ERR(dptr);
+            goto out;
+        }
+        data = scull_get_quantum(t, dptr, s_pos);
+        if (!IS_ERR(data))
+            dptr->prealloc = true;
+        up_write(&dptr->sem);
+        if (IS_ERR(data))
+        {
+            retval = PTR_ERR(data);
+            goto out;
+        }
+    }
+    if (!(mode & FALLOC_FL_KEEP_SIZE))
+        scull_grow(dev, end);
+
+out:
+    up_read(&dev->sem);
+    return retval;
+}
+
+int scull_open(struct inode *inode, struct file *filp)
+{
     struct scull_dev *dev = container_of(inode->i_cdev, struct scull_dev, cdev);
     filp->private_data = dev;
+    filp->f_mode |= FMODE_NOWAIT;
 
     if ((filp->f_flags & O_ACCMODE) == O_WRONLY)
     {
-        scull_trim(dev);
+        if (scull_trim(dev, inode->i_mapping))
+            return -ERESTARTSYS;
     }
 
+    trace_scull_open(iminor(inode), filp->f_flags);
     return 0;
 }
 
 int scull_release(struct inode *inode, struct file *filp)
 {
-    printk(KERN_ALERT "scull_release\n");
+    trace_scull_release(iminor(inode), filp->f_flags);
     return 0;
 }
 
+static void scull_show(struct seq_file *m, void *priv)
+{
+    struct scull_dev *dev = priv;
+    long zquanta, zbytes;
+
+    down_read(&dev->sem);
+    zquanta = atomic_long_read(&dev->tree->zquanta);
+    zbytes = atomic_long_read(&dev->tree->zbytes);
+    seq_printf(m, "size %lld\n", (long long)atomic64_read(&dev->size));
+    seq_printf(m, "quantum %d\nqset %d\n", dev->tree->quantum, dev->tree->qset);
+    seq_printf(m, "compressed %ld quanta in %ld bytes", zquanta, zbytes);
+    if (zbytes)
+        seq_printf(m, " (ratio %ld%%)", zquanta * dev->tree->quantum * 100 / zbytes);
+    seq_putc(m, '\n');
+    up_read(&dev->sem);
+}
+
+static ssize_t quantum_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    int quantum = 0, qset = 0;
+    int retval = scull_geometry(dev_get_drvdata(d), &quantum, &qset);
+
+    return retval ? retval : sysfs_emit(buf, "%d\n", quantum);
+}
+
+static ssize_t quantum_store(struct device *d, struct device_attribute *attr,
+                             const char *buf, size_t count)
+{
+    int quantum, qset = 0;
+    int retval = kstrtoint(buf, 0, &quantum);
+
+    if (retval)
+        return retval;
+    if (quantum <= 0)
+        return -EINVAL;
+    retval = scull_geometry(dev_get_drvdata(d), &quantum, &qset);
+    return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(quantum);
+
+static ssize_t qset_show(struct device *d, struct device_attribute *attr, char *buf)
+{
+    int quantum = 0, qset = 0;
+    int retval = scull_geometry(dev_get_drvdata(d), &quantum, &qset);
+
+    return retval ? retval : sysfs_emit(buf, "%d\n", qset);
+}
+
+static ssize_t qset_store(struct device *d, struct device_attribute *attr,
+                          const char *buf, size_t count)
+{
+    int quantum = 0, qset;
+    int retval = kstrtoint(buf, 0, &qset);
+
+    if (retval)
+        return retval;
+    if (qset <= 0)
+        return -EINVAL;
+    retval = scull_geometry(dev_get_drvdata(d), &quantum, &qset);
+    return retval ? retval : count;
+}
+static DEVICE_ATTR_RW(qset);
+
+static struct attribute *scull_attrs[] = {
+    &dev_attr_quantum.attr,
+    &dev_attr_qset.attr,
+    NULL,
+};
+ATTRIBUTE_GROUPS(scull);
+
 struct file_operations scull_fops = {
     .owner = THIS_MODULE,
     .llseek = scull_llseek,
-    .read = scull_read,
-    .write = scull_write,
+    .read_iter = scull_read_iter,
+    .write_iter = scull_write_iter,
     .unlocked_ioctl = scull_ioctl,
+    .mmap = scull_mmap,
+    .fallocate = scull_fallocate,
     .open = scull_open,
     .release = scull_release,
 };
 
+/*
+ * Under memory pressure the reserve goes first, then quanta holding
+ * nothing but zeros, which read back the same once they are holes.
+ * Quantum sets are scanned one at a time under their own lock, and
+ * skipped when that is taken (reclaim may be running for one of our
+ * own allocations, with it held), when the device is mapped, as user
+ * space can write to the pages without the lock, or when they were
+ * fallocated, since the point of that was to keep them.
+ */
+static unsigned long scull_shrink_dev(struct scull_dev *dev, unsigned long *nr)
+{
+    struct scull_qset *dptr;
+    struct scull_tree *t;
+    unsigned long index, freed = 0;
+    int i;
+
+    if (!down_read_trylock(&dev->sem))
+        return 0;
+    /* shared quanta are not this device's alone to free */
+    if (scull_tree_shares(dev->tree))
+        goto out;
+
+    t = dev->tree;
+    xa_for_each_start(&t->qsets, index, dptr, READ_ONCE(dev->reclaim))
+    {
+        if (!dptr->prealloc && down_write_trylock(&dptr->sem))
+        {
+            /* mmap() counts itself before its faults can take the set */
+            if (atomic_read(&dev->mapped))
+            {
+                up_write(&dptr->sem);
+                goto out;
+            }
+            for (i = 0; dptr->data && i < t->qset; i++)
+            {
+                if (!dptr->data[i] || scull_is_compressed(dptr->data[i]) ||
+                    memchr_inv(dptr->data[i], 0, t->quantum))
+                    continue;
+                scull_uncharge(t->quantum);
+                scull_del_quantum(t->quantum, dptr->data[i]);
+                dptr->data[i] = NULL;
+                freed++;
+            }
+            up_write(&dptr->sem);
+        }
+        if (*nr <= t->qset)
+        {
+            *nr = 0;
+            WRITE_ONCE(dev->reclaim, index + 1);
+            goto out;
+        }
+        *nr -= t->qset;
+        cond_resched();
+    }
+    WRITE_ONCE(dev->reclaim, 0);
+
+out:
+    up_read(&dev->sem);
+    return freed;
+}
+
+static unsigned long scull_shrink_count(struct shrinker *shrink, struct shrink_control *sc)
+{
+    return READ_ONCE(scull_pool_count) + max(atomic_long_read(&scull_zero_hint), 0L);
+}
+
+static unsigned long scull_shrink_scan(struct shrinker *shrink, struct shrink_control *sc)
+{
+    unsigned long nr = sc->nr_to_scan, freed = 0, zeros = 0;
+    void *data;
+    int i;
+
+    while (nr && (data = scull_pool_get()))
+    {
+        scull_del_quantum(scull_cache_quantum, data);
+        nr--;
+        freed++;
+    }
+    for (i = 0; i < 4 && nr; i++)
+        zeros += scull_shrink_dev(&scull_devs[i], &nr);
+    /* budget left over means every device was looked through */
+    if (nr)
+        atomic_long_set(&scull_zero_hint, 0);
+    else
+        atomic_long_sub(zeros, &scull_zero_hint);
+    freed += zeros;
+    return freed ? freed : SHRINK_STOP;
+}
+
+/*
+ * Compress the quantum sets of a device not touched since "cold", one
+ * set at a time; sets (or devices) in use are skipped rather than
+ * waited for. Fallocated sets are left as they are, ready for writes.
+ */
+static void scull_compress_dev(struct scull_dev *dev, unsigned long cold, void *wrkmem)
+{
+    struct scull_qset *dptr;
+    struct scull_tree *t;
+    unsigned long index = 0;
+    void *buf = NULL;
+    int quantum = 0;
+    int i;
+
+    while (down_read_trylock(&dev->sem))
+    {
+        t = dev->tree;
+        dptr = xa_find(&t->qsets, &index, ULONG_MAX, XA_PRESENT);
+        if (!dptr || atomic_read(&dev->mapped))
+            goto out;
+        if (quantum != t->quantum)
+        {
+            kvfree(buf);
+            quantum = t->quantum;
+            buf = kvmalloc(quantum, GFP_KERNEL);
+            if (!buf)
+                goto out;
+        }
+        if (!dptr->prealloc && time_before(READ_ONCE(dptr->atime), cold) &&
+            down_write_trylock(&dptr->sem))
+        {
+            for (i = 0; dptr->data && i < t->qset; i++)
+                scull_compress_quantum(t, &dptr->data[i], buf, wrkmem);
+            up_write(&dptr->sem);
+        }
+        up_read(&dev->sem);
+        if (index == ULONG_MAX)
+            break;
+        index++;
+        cond_resched();
+    }
+    kvfree(buf);
+    return;
+
+out:
+    up_read(&dev->sem);
+    kvfree(buf);
+}
+
+static void scull_compress_fn(struct work_struct *work)
+{
+    int age = READ_ONCE(scull_compress_age);
+    void *wrkmem;
+    int i;
+
+    if (!age)
+        return;
+    wrkmem = kvmalloc(LZ4_MEM_COMPRESS, GFP_KERNEL);
+    for (i = 0; i < 4 && wrkmem; i++)
+        scull_compress_dev(&scull_devs[i], jiffies - age * HZ, wrkmem);
+    kvfree(wrkmem);
+    queue_delayed_work(scull_wq, &scull_compress_work, age * HZ);
+}
+
 static int __init scull_init(void)
 {
     int res;
     int i, j;
+    char name[16];
+
+    scull_stats_setup();
+
+    res = scull_mem_init();
+    if (res < 0)
+    {
+        printk(KERN_ALERT "Failed to set up the quantum caches\n");
+        goto fail_mem_init;
+    }
 
     res = alloc_chrdev_region(&scull_devno, 0, 4, "scull");
     if (res < 0)
@@ -370,14 +2038,26 @@ static int __init scull_init(void)
 
     for (i = 0; i < 4; i++)
     {
-        device_create(scull_class, NULL, MKDEV(MAJOR(scull_devno), i), NULL, "scull%d", i);
+        scull_devs[i].tree = scull_alloc_tree(scull_quantum, scull_qset);
+        if (!scull_devs[i].tree)
+        {
+            res = -ENOMEM;
+            goto fail_alloc_tree;
+        }
+        atomic_set(&scull_devs[i].mapped, 0);
+        init_rwsem(&scull_devs[i].sem);
+    }
+
+    for (i = 0; i < 4; i++)
+    {
+        device_create_with_groups(scull_class, NULL, MKDEV(MAJOR(scull_devno), i),
+                                  &scull_devs[i], scull_groups, "scull%d", i);
     }
 
     for (i = 0; i < 4; i++)
     {
-        scull_devs[i].quantum = scull_quantum;
-        scull_devs[i].qset = scull_qset;
-        sema_init(&scull_devs[i].sem, 1);
+        snprintf(name, sizeof(name), "scull%d", i);
+        scull_stats_init(&scull_devs[i].stats, name, scull_show, &scull_devs[i]);
         cdev_init(&scull_devs[i].cdev, &scull_fops);
         scull_devs[i].cdev.owner = THIS_MODULE;
         res = cdev_add(&scull_devs[i].cdev, MKDEV(MAJOR(scull_devno), i), 1);
@@ -388,10 +2068,31 @@ static int __init scull_init(void)
             {
                 cdev_del(&scull_devs[j].cdev);
             }
+            for (j = 0; j <= i; j++)
+                scull_stats_cleanup(&scull_devs[j].stats);
             goto fail_cdev_add;
         }
     }
 
+    scull_shrinker = shrinker_alloc(0, "scull");
+    if (scull_shrinker)
+    {
+        scull_shrinker->count_objects = scull_shrink_count;
+        scull_shrinker->scan_objects = scull_shrink_scan;
+        shrinker_register(scull_shrinker);
+    }
+    else
+    {
+        printk(KERN_WARNING "scull: no shrinker, running without\n");
+    }
+
+    INIT_DELAYED_WORK(&scull_compress_work, scull_compress_fn);
+    kernel_param_lock(THIS_MODULE);
+    scull_compress_live = true;
+    if (scull_compress_age)
+        queue_delayed_work(scull_wq, &scull_compress_work, scull_compress_age * HZ);
+    kernel_param_unlock(THIS_MODULE);
+
     scull_devno += scull_p_init();
 
     printk(KERN_ALERT "Hello, world\n");
@@ -402,26 +2103,42 @@ fail_cdev_add:
     {
         device_destroy(scull_class, MKDEV(MAJOR(scull_devno), j));
     }
+    i = 4;
+fail_alloc_tree:
+    for (j = 0; j < i; j++)
+        scull_free_tree(scull_devs[j].tree);
     class_destroy(scull_class);
 fail_class_create:
     unregister_chrdev_region(scull_devno, 4);
 fail_alloc_chrdev:
+    scull_mem_cleanup();
+fail_mem_init:
+    scull_stats_teardown();
     return res;
 }
 
 static void __exit scull_exit(void)
 {
     int i;
+
+    shrinker_free(scull_shrinker);
+    kernel_param_lock(THIS_MODULE);
+    scull_compress_live = false;
+    kernel_param_unlock(THIS_MODULE);
+    cancel_delayed_work_sync(&scull_compress_work);
     for (i = 0; i < 4; i++)
     {
-        scull_trim(&scull_devs[i]); // Free all allocated memory
         cdev_del(&scull_devs[i].cdev);
+        scull_stats_cleanup(&scull_devs[i].stats);
         device_destroy(scull_class, MKDEV(MAJOR(scull_devno), i));
+        scull_free_tree_async(scull_devs[i].tree); // freed in parallel, waited for below
     }
     class_destroy(scull_class);
     unregister_chrdev_region(scull_devno, 4);
 
     scull_p_cleanup();
+    scull_mem_cleanup();
+    scull_stats_teardown();
 
     printk(KERN_ALERT "Goodbye, cruel world\n");
 }
@@ -3,6 +3,7 @@
 #include <linux/kernel.h>
 #include <linux/slab.h>
 #include <linux/fs.h>
+#include <linux/limits.h>
 #include <linux/proc_fs.h>
 #include <linux/errno.h>
 #include <linux/types.h>
@@ -10,22 +11,82 @@
 #include <linux/poll.h>
 #include <linux/cdev.h>
 #include <linux/sched.h>
+#include <linux/mutex.h>
+#include <linux/log2.h>
+#include <linux/uio.h>
+#include <linux/splice.h>
+#include <linux/workqueue.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/list.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
 #include <asm/uaccess.h>
 
 #include "scull.h"
 
+/*
+ * The ring is a power of two in size and indexed by free-running
+ * counters: "head" only ever moves forward in writers, "tail" only in
+ * readers, and head - tail is the amount of data buffered. Each side
+ * publishes its counter with a release store and reads the other with
+ * an acquire load, so readers and writers never share a lock; rlock and
+ * wlock only serialize readers among themselves and writers among
+ * themselves, and are uncontended with a single reader and writer.
+ * Replacing the buffer needs both, always taken wlock first.
+ *
+ * "basesize" is the size asked for with SCULL_P_IOCTSIZE (or the module
+ * parameter). With adaptive sizing on, a writer that would block grows
+ * the ring up to "adapt_max", and shrink_work halves it back towards
+ * basesize once writers have been idle for SCULL_P_IDLE, and none is
+ * waiting for room ("wwaiting").
+ *
+ * In packet mode (SCULL_P_IOCTPACKET) the ring holds records, each a u32
+ * length followed by that many bytes of payload.
+ *
+ * In broadcast mode (SCULL_P_IOCTBCAST) every reader has its own cursor
+ * and sees the whole stream; "tail" then follows the slowest reader.
+ *
+ * rlowat and wlowat are the wakeup watermarks, as SO_RCVLOWAT and
+ * SO_SNDLOWAT: readers (and poll) wait for rlowat bytes of data, writers
+ * for wlowat bytes of room. Readers and writers sleep exclusively and
+ * pass the wakeup on when there is enough left for the next one.
+ */
 struct scull_pipe
 {
     wait_queue_head_t inq, outq;
-    char *buffer, *end;
-    int buffersize;
-    char *rp, *wp;
+    char *buffer;
+    unsigned int buffersize;
+    unsigned int head, tail;
+    unsigned int basesize, adapt_max;
+    unsigned long last_write;
+    bool packet;
+    int bcast;
+    unsigned int rlowat, wlowat;
+    struct list_head readers;
+    struct delayed_work shrink_work;
+    atomic_t wwaiting;
     int nreaders, nwriters;
     struct fasync_struct *async_queue;
+    struct mutex rlock, wlock;
     struct semaphore sem;
+    struct scull_stats stats;
     struct cdev cdev;
 };
 
+#define SCULL_P_IDLE HZ
+
+/*
+ * Per-open state. Files open for reading sit on dev->readers (under
+ * rlock), and "tail" is their cursor in broadcast mode.
+ */
+struct scull_p_file
+{
+    struct scull_pipe *dev;
+    struct list_head list;
+    unsigned int tail;
+};
+
 static struct class *scull_pipe_class = NULL;
 static int scull_p_nr_devs = SCULL_P_NR_DEVS;
 int scull_p_buffer = SCULL_P_BUFFER;
@@ -37,194 +98,1009 @@ module_param(scull_p_buffer, int, 0);
 static struct scull_pipe *scull_p_devices;
 
 static int scull_p_fasync(int fd, struct file *filp, int mode);
-static int spacefree(struct scull_pipe *dev);
+static unsigned int spacefree(struct scull_pipe *dev);
+static bool scull_p_readable(struct scull_pipe *dev, struct scull_p_file *pf);
+static bool scull_p_writable(struct scull_pipe *dev, size_t need);
+static void scull_p_write_wakeup(struct scull_pipe *dev, unsigned int before);
+
+/*
+ * Where reader "pf" reads from next.
+ */
+static unsigned int scull_p_rtail(struct scull_pipe *dev, struct scull_p_file *pf)
+{
+    return dev->bcast ? READ_ONCE(pf->tail) : smp_load_acquire(&dev->tail);
+}
+
+/*
+ * Broadcast mode: free space up to the slowest reader. Once no reader
+ * is left, whatever is buffered is dropped. Called with rlock held.
+ */
+static void scull_p_update_tail(struct scull_pipe *dev)
+{
+    struct scull_p_file *pf;
+    unsigned int tail = dev->tail;
+    unsigned int lag = smp_load_acquire(&dev->head) - tail;
+
+    list_for_each_entry(pf, &dev->readers, list)
+        lag = min(lag, pf->tail - tail);
+    smp_store_release(&dev->tail, tail + lag);
+}
+
+/*
+ * Broadcast mode with nobody reading: whatever is buffered would never
+ * be read, and a reader opening later starts at head anyway, so it is
+ * dropped. Called with rlock held.
+ */
+static void scull_p_drop_unread(struct scull_pipe *dev)
+{
+    if (dev->bcast && list_empty(&dev->readers))
+        smp_store_release(&dev->tail, dev->head);
+}
+
+/*
+ * Reader "pf" is done with everything before "tail".
+ */
+static void scull_p_consume(struct scull_pipe *dev, struct scull_p_file *pf, unsigned int tail)
+{
+    if (dev->bcast)
+    {
+        pf->tail = tail;
+        scull_p_update_tail(dev);
+    }
+    else
+    {
+        smp_store_release(&dev->tail, tail);
+    }
+}
+
+/*
+ * Take rlock or wlock, counting the times someone else had it. With
+ * IOCB_NOWAIT a contended lock is -EAGAIN, for io_uring to retry.
+ */
+static int scull_p_lock(struct scull_pipe *dev, struct mutex *lock, bool nowait)
+{
+    if (mutex_trylock(lock))
+        return 0;
+    scull_stats_contended(&dev->stats);
+    if (nowait)
+        return -EAGAIN;
+    return mutex_lock_interruptible(lock) ? -ERESTARTSYS : 0;
+}
 
 static int scull_p_open(struct inode *inode, struct file *filp)
 {
     struct scull_pipe *dev;
+    struct scull_p_file *pf;
 
     dev = container_of(inode->i_cdev, struct scull_pipe, cdev);
-    filp->private_data = dev;
+    pf = kzalloc(sizeof(*pf), GFP_KERNEL);
+    if (!pf)
+        return -ENOMEM;
+    pf->dev = dev;
+    INIT_LIST_HEAD(&pf->list);
+    filp->private_data = pf;
 
     if (down_interruptible(&dev->sem))
+    {
+        kfree(pf);
         return -ERESTARTSYS;
+    }
     if (!dev->buffer)
     {
-        dev->buffer = kmalloc(scull_p_buffer, GFP_KERNEL);
+        if (!dev->basesize)
+            dev->basesize = roundup_pow_of_two(clamp(scull_p_buffer, 2, SCULL_P_MAX_BUFFER));
+        dev->buffersize = dev->basesize;
+        dev->buffer = kvmalloc(dev->buffersize, GFP_KERNEL);
         if (!dev->buffer)
         {
             up(&dev->sem);
+            kfree(pf);
             return -ENOMEM;
         }
+        dev->head = dev->tail = 0;
     }
-    dev->buffersize = scull_p_buffer;
-    dev->end = dev->buffer + dev->buffersize;
-    dev->rp = dev->wp = dev->buffer;
 
     if (filp->f_mode & FMODE_READ)
+    {
         dev->nreaders++;
+        mutex_lock(&dev->rlock);
+        scull_p_drop_unread(dev);
+        pf->tail = smp_load_acquire(&dev->head);
+        list_add(&pf->list, &dev->readers);
+        mutex_unlock(&dev->rlock);
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters++;
     up(&dev->sem);
 
+    filp->f_mode |= FMODE_NOWAIT;
     return nonseekable_open(inode, filp);
 }
 
 static int scull_p_release(struct inode *inode, struct file *filp)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
 
     scull_p_fasync(-1, filp, 0);
     down(&dev->sem);
     if (filp->f_mode & FMODE_READ)
+    {
         dev->nreaders--;
+        mutex_lock(&dev->rlock);
+        list_del(&pf->list);
+        if (dev->bcast)
+            scull_p_update_tail(dev);
+        mutex_unlock(&dev->rlock);
+        wake_up_interruptible(&dev->outq);
+    }
     if (filp->f_mode & FMODE_WRITE)
         dev->nwriters--;
     if (dev->nreaders + dev->nwriters == 0)
     {
-        kfree(dev->buffer);
+        cancel_delayed_work_sync(&dev->shrink_work);
+        kvfree(dev->buffer);
         dev->buffer = NULL;
     }
     up(&dev->sem);
+    kfree(pf);
     return 0;
 }
 
-static unsigned int scull_p_poll(struct file *filp, poll_table *wait)
+/*
+ * Also what io_uring arms after an -EAGAIN, to retry once ready.
+ */
+static __poll_t scull_p_poll(struct file *filp, poll_table *wait)
 {
-    struct scull_pipe *dev = filp->private_data;
-    unsigned int mask = 0;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    __poll_t mask = 0;
 
-    down(&dev->sem);
     poll_wait(filp, &dev->inq, wait);
     poll_wait(filp, &dev->outq, wait);
-    if (dev->rp != dev->wp)
-        mask |= POLLIN | POLLRDNORM;
-    if (spacefree(dev))
-        mask |= POLLOUT | POLLWRNORM;
-    up(&dev->sem);
+    if (scull_p_readable(dev, pf))
+        mask |= EPOLLIN | EPOLLRDNORM;
+    if (scull_p_writable(dev, 1))
+        mask |= EPOLLOUT | EPOLLWRNORM;
     return mask;
 }
 
 static int scull_p_fasync(int fd, struct file *filp, int mode)
 {
-    struct scull_pipe *dev = filp->private_data;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
     return fasync_helper(fd, filp, mode, &dev->async_queue);
 }
 
-static ssize_t scull_p_read(struct file *filp, char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * Move the buffered data to the start of a new buffer of "size" bytes,
+ * which must hold it. Called with wlock and rlock held.
+ */
+static void scull_p_relocate(struct scull_pipe *dev, char *buffer, unsigned int size)
 {
-    struct scull_pipe *dev = filp->private_data;
+    unsigned int used = dev->head - dev->tail;
+    unsigned int off = dev->tail & (dev->buffersize - 1);
+    unsigned int first = min(used, dev->buffersize - off);
+    struct scull_p_file *pf;
 
-    if (down_interruptible(&dev->sem))
+    memcpy(buffer, dev->buffer + off, first);
+    memcpy(buffer + first, dev->buffer, used - first);
+    list_for_each_entry(pf, &dev->readers, list)
+        pf->tail -= dev->tail;
+    kvfree(dev->buffer);
+    dev->buffer = buffer;
+    dev->buffersize = size;
+    smp_store_release(&dev->tail, 0);
+    smp_store_release(&dev->head, used);
+}
+
+/*
+ * Readers wait for no more than the ring holds, so a smaller one may
+ * satisfy them with the data already there: wake them as a write would.
+ * Called after resizing from "oldsize", with rlock held.
+ */
+static void scull_p_resize_wakeup(struct scull_pipe *dev, unsigned int oldsize)
+{
+    if (dev->head - dev->tail < min(dev->rlowat, oldsize))
+        scull_p_write_wakeup(dev, 0);
+}
+
+static int scull_p_resize(struct scull_pipe *dev, unsigned long size)
+{
+    unsigned int oldsize;
+    char *buffer;
+    int retval = 0;
+
+    if (size < 2 || size > SCULL_P_MAX_BUFFER)
+        return -EINVAL;
+    size = roundup_pow_of_two(size);
+
+    buffer = kvmalloc(size, GFP_KERNEL);
+    if (!buffer)
+        return -ENOMEM;
+
+    if (mutex_lock_interruptible(&dev->wlock))
+    {
+        kvfree(buffer);
         return -ERESTARTSYS;
+    }
+    mutex_lock(&dev->rlock);
+    if (dev->head - dev->tail > size)
+    {
+        kvfree(buffer);
+        retval = -EBUSY;
+    }
+    else
+    {
+        oldsize = dev->buffersize;
+        scull_p_relocate(dev, buffer, size);
+        dev->basesize = size;
+        scull_p_resize_wakeup(dev, oldsize);
+    }
+    mutex_unlock(&dev->rlock);
+    mutex_unlock(&dev->wlock);
+
+    wake_up_interruptible_all(&dev->outq);
+    return retval;
+}
+
+/*
+ * Adaptive sizing: make room for "need" more bytes by doubling the
+ * ring, within adapt_max. Failure is not an error; the writer just
+ * waits as usual. Called with wlock held.
+ */
+static void scull_p_grow(struct scull_pipe *dev, size_t need)
+{
+    unsigned int used = dev->head - dev->tail;
+    unsigned int size = dev->buffersize;
+    char *buffer;
+
+    while (size < dev->adapt_max && size - used < need)
+        size *= 2;
+    if (size == dev->buffersize)
+        return;
+
+    buffer = kvmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+    if (!buffer)
+        return;
+
+    mutex_lock(&dev->rlock);
+    scull_p_relocate(dev, buffer, size);
+    mutex_unlock(&dev->rlock);
+
+    schedule_delayed_work(&dev->shrink_work, SCULL_P_IDLE);
+}
+
+static void scull_p_shrink(struct work_struct *work)
+{
+    struct scull_pipe *dev = container_of(to_delayed_work(work), struct scull_pipe, shrink_work);
+    unsigned int size;
+    char *buffer;
 
-    while (dev->rp == dev->wp)
+    mutex_lock(&dev->wlock);
+    if (!dev->buffer || dev->buffersize <= dev->basesize)
+        goto out;
+    if (time_before(jiffies, READ_ONCE(dev->last_write) + SCULL_P_IDLE) ||
+        atomic_read(&dev->wwaiting))
+        goto again;
+
+    size = dev->buffersize / 2;
+    if (dev->head - smp_load_acquire(&dev->tail) > size)
+        goto again;
+    buffer = kvmalloc(size, GFP_KERNEL | __GFP_NOWARN);
+    if (!buffer)
+        goto again;
+
+    mutex_lock(&dev->rlock);
+    if (dev->head - dev->tail > size)
+    {
+        kvfree(buffer);
+    }
+    else
+    {
+        scull_p_relocate(dev, buffer, size);
+        scull_p_resize_wakeup(dev, size * 2);
+    }
+    mutex_unlock(&dev->rlock);
+
+again:
+    if (dev->buffersize > dev->basesize)
+        schedule_delayed_work(&dev->shrink_work, SCULL_P_IDLE);
+out:
+    mutex_unlock(&dev->wlock);
+}
+
+/*
+ * Copy n bytes between the ring, starting at counter pos, and an
+ * iov_iter. Data that wraps past the end of the buffer is moved in a
+ * second piece from its start.
+ */
+static size_t scull_p_copy_out(struct scull_pipe *dev, unsigned int pos,
+                               size_t n, struct iov_iter *to)
+{
+    unsigned int off = pos & (dev->buffersize - 1);
+    size_t first = min_t(size_t, n, dev->buffersize - off);
+    size_t copied;
+
+    copied = copy_to_iter(dev->buffer + off, first, to);
+    if (copied == first && n > first)
+        copied += copy_to_iter(dev->buffer, n - first, to);
+    return copied;
+}
+
+static size_t scull_p_copy_in(struct scull_pipe *dev, unsigned int pos,
+                              size_t n, struct iov_iter *from)
+{
+    unsigned int off = pos & (dev->buffersize - 1);
+    size_t first = min_t(size_t, n, dev->buffersize - off);
+    size_t copied;
+
+    copied = copy_from_iter(dev->buffer + off, first, from);
+    if (copied == first && n > first)
+        copied += copy_from_iter(dev->buffer, n - first, from);
+    return copied;
+}
+
+static void scull_p_get(struct scull_pipe *dev, unsigned int pos, void *to, size_t n)
+{
+    unsigned int off = pos & (dev->buffersize - 1);
+    size_t first = min_t(size_t, n, dev->buffersize - off);
+
+    memcpy(to, dev->buffer + off, first);
+    memcpy(to + first, dev->buffer, n - first);
+}
+
+static void scull_p_put(struct scull_pipe *dev, unsigned int pos, const void *from, size_t n)
+{
+    unsigned int off = pos & (dev->buffersize - 1);
+    size_t first = min_t(size_t, n, dev->buffersize - off);
+
+    memcpy(dev->buffer + off, from, first);
+    memcpy(dev->buffer, from + first, n - first);
+}
+
+/*
+ * Enough data buffered for reader "pf" to be worth waking?
+ */
+static bool scull_p_readable(struct scull_pipe *dev, struct scull_p_file *pf)
+{
+    unsigned int lowat = min(READ_ONCE(dev->rlowat), READ_ONCE(dev->buffersize));
+
+    return smp_load_acquire(&dev->head) - scull_p_rtail(dev, pf) >= lowat;
+}
+
+/*
+ * Wait until there is enough to read. Called with rlock held; returns
+ * with it released on error. A reader that was woken but gives up
+ * hands the wakeup on to the next one.
+ */
+static int scull_getreaddata(struct scull_pipe *dev, struct scull_p_file *pf, bool nonblock)
+{
+    u64 start;
+    int result;
+
+    while (!scull_p_readable(dev, pf))
     {
-        up(&dev->sem);
-        if (filp->f_flags & O_NONBLOCK)
+        mutex_unlock(&dev->rlock);
+        if (nonblock)
             return -EAGAIN;
         PDEBUG("\"%s\" reading: going to sleep\n", current->comm);
-        if (wait_event_interruptible(dev->inq, (dev->rp != dev->wp)))
-            return -ERESTARTSYS;
-        if (down_interruptible(&dev->sem))
-            return -ERESTARTSYS;
+        start = local_clock();
+        result = wait_event_interruptible_exclusive(dev->inq, scull_p_readable(dev, pf));
+        scull_stats_blocked(&dev->stats, start);
+        if (result || mutex_lock_interruptible(&dev->rlock))
+            goto pass_on;
     }
+    return 0;
 
-    if (dev->wp > dev->rp)
-        count = min(count, (size_t)(dev->wp - dev->rp));
-    else
-        count = min(count, (size_t)(dev->end - dev->rp));
+pass_on:
+    if (scull_p_readable(dev, pf))
+        wake_up_interruptible(&dev->inq);
+    return -ERESTARTSYS;
+}
 
-    if (copy_to_user(buf, dev->rp, count))
-    {
-        up(&dev->sem);
+/*
+ * After a read: wake a writer if there is now enough room, and the next
+ * reader if there is still enough data.
+ */
+static void scull_p_read_wakeup(struct scull_pipe *dev, struct scull_p_file *pf)
+{
+    if (wq_has_sleeper(&dev->outq) && scull_p_writable(dev, 1))
+        wake_up_interruptible(&dev->outq);
+    if (!dev->bcast && wq_has_sleeper(&dev->inq) && scull_p_readable(dev, pf))
+        wake_up_interruptible(&dev->inq);
+}
+
+/*
+ * Consume one record. If "to" is too small the record is truncated and
+ * the rest of it discarded, as for datagram sockets; *reclen gets its
+ * full length. Called with rlock held and the ring not empty. A length
+ * running past the buffered data means the ring does not hold records,
+ * and is -EIO rather than trusted.
+ */
+static ssize_t scull_p_read_record(struct scull_pipe *dev, struct scull_p_file *pf,
+                                   struct iov_iter *to, u32 *reclen)
+{
+    unsigned int tail = scull_p_rtail(dev, pf);
+    unsigned int used = smp_load_acquire(&dev->head) - tail;
+    size_t count;
+    u32 len;
+
+    if (used < sizeof(len))
+        return -EIO;
+    scull_p_get(dev, tail, &len, sizeof(len));
+    if (len > used - sizeof(len))
+        return -EIO;
+    count = min_t(size_t, len, iov_iter_count(to));
+    if (scull_p_copy_out(dev, tail + sizeof(len), count, to) < count)
         return -EFAULT;
-    }
 
-    dev->rp += count;
-    if (dev->rp == dev->end)
-        dev->rp = dev->buffer;
-    up(&dev->sem);
+    scull_p_consume(dev, pf, tail + sizeof(len) + len);
+    if (reclen)
+        *reclen = len;
+    return count;
+}
+
+static ssize_t scull_p_do_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    unsigned int head, tail;
+    ssize_t count;
+    int result;
+
+    result = scull_p_lock(dev, &dev->rlock, nowait);
+    if (result)
+        return result;
+
+    result = scull_getreaddata(dev, pf, nowait || (filp->f_flags & O_NONBLOCK));
+    if (result)
+        return result;
 
-    wake_up_interruptible(&dev->outq);
+    if (dev->packet)
+    {
+        count = scull_p_read_record(dev, pf, to, NULL);
+    }
+    else
+    {
+        tail = scull_p_rtail(dev, pf);
+        head = smp_load_acquire(&dev->head);
+        count = min(iov_iter_count(to), (size_t)(head - tail));
+        count = scull_p_copy_out(dev, tail, count, to);
+        if (!count && iov_iter_count(to))
+            count = -EFAULT;
+        else
+            scull_p_consume(dev, pf, tail + count);
+    }
+    mutex_unlock(&dev->rlock);
+    if (count < 0)
+        return count;
+
+    scull_p_read_wakeup(dev, pf);
     PDEBUG("\"%s\" did read %li bytes\n", current->comm, (long)count);
     return count;
 }
 
-static int spacefree(struct scull_pipe *dev)
+static ssize_t scull_p_read_iter(struct kiocb *iocb, struct iov_iter *to)
+{
+    struct scull_p_file *pf = iocb->ki_filp->private_data;
+    u64 start = local_clock();
+    ssize_t retval;
+
+    retval = scull_p_do_read_iter(iocb, to);
+    scull_stats_account(&pf->dev->stats, SCULL_STAT_READ, retval, start);
+    return retval;
+}
+
+static unsigned int spacefree(struct scull_pipe *dev)
 {
-    if (dev->rp == dev->wp)
-        return dev->buffersize - 1;
-    return ((dev->rp + dev->buffersize - dev->wp) % dev->buffersize) - 1;
+    return dev->buffersize - (READ_ONCE(dev->head) - smp_load_acquire(&dev->tail));
 }
 
-static int scull_getwritespace(struct scull_pipe *dev, struct file *filp)
+/*
+ * Room for "need" bytes, and at least the write watermark?
+ */
+static bool scull_p_writable(struct scull_pipe *dev, size_t need)
 {
-    while (spacefree(dev) == 0)
+    unsigned int lowat = min(READ_ONCE(dev->wlowat), READ_ONCE(dev->buffersize));
+
+    return spacefree(dev) >= max_t(size_t, need, lowat);
+}
+
+/*
+ * Wait for room for "need" bytes. Called with wlock held; returns with
+ * it released on error.
+ *
+ * The ring can be made smaller (SCULL_P_IOCTSIZE) while we sleep, or
+ * be too small to begin with if growing it failed, so "need" is checked
+ * against it on every pass: the ring is grown if it may be, a byte
+ * stream writer then settles for what the ring holds, and a record
+ * that no longer fits is -EMSGSIZE. Sleepers are counted in wwaiting,
+ * which keeps shrink_work off.
+ */
+static int scull_getwritespace(struct scull_pipe *dev, bool nonblock, size_t need)
+{
+    u64 start;
+
+    while (!scull_p_writable(dev, need))
     {
         DEFINE_WAIT(wait);
 
-        up(&dev->sem);
-        if (filp->f_flags & O_NONBLOCK)
+        if (need > dev->buffersize && !nonblock)
+            scull_p_grow(dev, need);
+        if (need > dev->buffersize && !dev->packet)
+        {
+            need = dev->buffersize;
+            continue;
+        }
+        if (need > dev->buffersize)
+        {
+            mutex_unlock(&dev->wlock);
+            /* a blocking write may still grow the ring for the record */
+            if (nonblock && need <= max(dev->buffersize, dev->adapt_max))
+                return -EAGAIN;
+            return -EMSGSIZE;
+        }
+
+        mutex_unlock(&dev->wlock);
+        if (nonblock)
             return -EAGAIN;
         PDEBUG("\"%s\" writing: going to sleep\n", current->comm);
-        prepare_to_wait(&dev->outq, &wait, TASK_INTERRUPTIBLE);
-        if (spacefree(dev) == 0)
+        start = local_clock();
+        atomic_inc(&dev->wwaiting);
+        prepare_to_wait_exclusive(&dev->outq, &wait, TASK_INTERRUPTIBLE);
+        if (!scull_p_writable(dev, need))
             schedule();
         finish_wait(&dev->outq, &wait);
-        if (signal_pending(current))
-            return -ERESTARTSYS;
-        if (down_interruptible(&dev->sem))
+        atomic_dec(&dev->wwaiting);
+        scull_stats_blocked(&dev->stats, start);
+        if (signal_pending(current) || mutex_lock_interruptible(&dev->wlock))
+        {
+            if (scull_p_writable(dev, 1))
+                wake_up_interruptible(&dev->outq);
             return -ERESTARTSYS;
+        }
     }
     return 0;
 }
 
-static ssize_t scull_p_write(struct file *filp, const char __user *buf, size_t count, loff_t *f_pos)
+/*
+ * After "before" bytes of buffered data became more: wake readers once
+ * there is enough for them (all of them in broadcast mode), and signal
+ * async readers when the watermark is crossed.
+ */
+static void scull_p_write_wakeup(struct scull_pipe *dev, unsigned int before)
 {
-    struct scull_pipe *dev = filp->private_data;
+    unsigned int lowat = min(READ_ONCE(dev->rlowat), READ_ONCE(dev->buffersize));
+    unsigned int used = READ_ONCE(dev->head) - smp_load_acquire(&dev->tail);
+
+    if (used < lowat)
+        return;
+    if (wq_has_sleeper(&dev->inq))
+    {
+        if (dev->bcast)
+            wake_up_interruptible_all(&dev->inq);
+        else
+            wake_up_interruptible(&dev->inq);
+    }
+    if (dev->async_queue && before < lowat)
+        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
+}
+
+/*
+ * Broadcast mode with SCULL_P_BCAST_DROP: rather than wait for slow
+ * readers, move every reader that is in the way forward far enough to
+ * free "need" bytes (in packet mode, to the next record boundary past
+ * that). Called with wlock held.
+ */
+static void scull_p_drop_laggards(struct scull_pipe *dev, size_t need)
+{
+    struct scull_p_file *pf;
+    unsigned int head = dev->head;
+    unsigned int target = head + need - dev->buffersize;
+    unsigned int tail;
+    u32 len;
+
+    if (need > dev->buffersize)
+        return;
+
+    mutex_lock(&dev->rlock);
+    tail = dev->tail;
+    if (dev->packet)
+    {
+        while ((int)(target - tail) > 0 && head - tail >= sizeof(len))
+        {
+            scull_p_get(dev, tail, &len, sizeof(len));
+            if (len > head - tail - sizeof(len))
+                break;
+            tail += sizeof(len) + len;
+        }
+    }
+    else if ((int)(target - tail) > 0)
+    {
+        tail = target;
+    }
+    list_for_each_entry(pf, &dev->readers, list)
+        if ((int)(tail - pf->tail) > 0)
+            pf->tail = tail;
+    scull_p_update_tail(dev);
+    mutex_unlock(&dev->rlock);
+}
+
+/*
+ * Before a writer waits for "need" bytes, drop what a broadcast ring
+ * holds for no reader at all, then try growing the ring and dropping
+ * data for lagging broadcast readers. Called with wlock held. These
+ * may sleep, so IOCB_NOWAIT writers only do the first, if rlock is free.
+ */
+static void scull_p_makeroom(struct scull_pipe *dev, size_t need, bool nowait)
+{
+    if (dev->bcast && list_empty_careful(&dev->readers) &&
+        (!nowait || mutex_trylock(&dev->rlock)))
+    {
+        if (!nowait)
+            mutex_lock(&dev->rlock);
+        scull_p_drop_unread(dev);
+        mutex_unlock(&dev->rlock);
+    }
+    if (nowait)
+        return;
+    if (dev->adapt_max > dev->buffersize && spacefree(dev) < need)
+        scull_p_grow(dev, need);
+    if (dev->bcast == SCULL_P_BCAST_DROP && spacefree(dev) < need)
+        scull_p_drop_laggards(dev, need);
+}
+
+/*
+ * Packet mode: the whole write becomes one record, or fails with
+ * -EMSGSIZE if it could never fit. Called with wlock held, which it
+ * drops.
+ */
+static ssize_t scull_p_write_record(struct scull_pipe *dev, struct kiocb *iocb, struct iov_iter *from)
+{
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    size_t count = iov_iter_count(from);
+    size_t need = sizeof(u32) + count;
+    unsigned int head, before;
+    u32 len = count;
     int result;
 
-    if (down_interruptible(&dev->sem))
-        return -ERESTARTSYS;
+    if (need > max(dev->buffersize, dev->adapt_max))
+    {
+        mutex_unlock(&dev->wlock);
+        return -EMSGSIZE;
+    }
+    scull_p_makeroom(dev, need, nowait);
+    result = scull_getwritespace(dev, nowait || (iocb->ki_filp->f_flags & O_NONBLOCK), need);
+    if (result)
+        return result;
+    /* the mode cannot change under a waiting writer, but be sure */
+    if (!dev->packet)
+    {
+        mutex_unlock(&dev->wlock);
+        return -EAGAIN;
+    }
 
-    result = scull_getwritespace(dev, filp);
+    head = dev->head;
+    before = head - smp_load_acquire(&dev->tail);
+    scull_p_put(dev, head, &len, sizeof(len));
+    if (scull_p_copy_in(dev, head + sizeof(len), count, from) < count)
+    {
+        mutex_unlock(&dev->wlock);
+        return -EFAULT;
+    }
+    smp_store_release(&dev->head, head + need);
+    WRITE_ONCE(dev->last_write, jiffies);
+    mutex_unlock(&dev->wlock);
+
+    scull_p_write_wakeup(dev, before);
+    if (wq_has_sleeper(&dev->outq) && scull_p_writable(dev, 1))
+        wake_up_interruptible(&dev->outq);
+    return count;
+}
+
+/*
+ * A blocking write returns only once all of it has been accepted.
+ * Writes of up to PIPE_BUF bytes (or the ring size, if smaller) are
+ * atomic: they wait until they fit as a whole and are never interleaved
+ * with other writers.
+ */
+static ssize_t scull_p_do_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct file *filp = iocb->ki_filp;
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    size_t count = iov_iter_count(from);
+    size_t need, chunk, copied;
+    bool nowait = iocb->ki_flags & IOCB_NOWAIT;
+    ssize_t written = 0;
+    unsigned int head, before;
+    int result;
+
+    result = scull_p_lock(dev, &dev->wlock, nowait);
     if (result)
         return result;
+    if (dev->packet)
+        return scull_p_write_record(dev, iocb, from);
+
+    need = count <= min_t(size_t, PIPE_BUF, dev->buffersize) ? count : 1;
+    while (iov_iter_count(from))
+    {
+        scull_p_makeroom(dev, need, nowait);
+        result = scull_getwritespace(dev, nowait || (filp->f_flags & O_NONBLOCK), need);
+        if (result)
+            return written ? written : result;
+        /*
+         * wlock was dropped while waiting: unframed bytes must not go
+         * into a ring that has switched to records meanwhile.
+         */
+        if (dev->packet)
+        {
+            if (!written)
+                return scull_p_write_record(dev, iocb, from);
+            break;
+        }
+
+        head = dev->head;
+        before = head - smp_load_acquire(&dev->tail);
+        chunk = min_t(size_t, iov_iter_count(from), dev->buffersize - before);
+        PDEBUG("Going to accept %li bytes at %u\n", (long)chunk, head);
+        copied = scull_p_copy_in(dev, head, chunk, from);
+        smp_store_release(&dev->head, head + copied);
+        WRITE_ONCE(dev->last_write, jiffies);
+        written += copied;
+
+        scull_p_write_wakeup(dev, before);
 
-    count = min(count, (size_t)spacefree(dev));
-    if (dev->wp >= dev->rp)
-        count = min(count, (size_t)(dev->end - dev->wp));
+        if (copied < chunk)
+        {
+            if (!written)
+                written = -EFAULT;
+            break;
+        }
+        need = 1;
+    }
+    mutex_unlock(&dev->wlock);
+
+    if (wq_has_sleeper(&dev->outq) && scull_p_writable(dev, 1))
+        wake_up_interruptible(&dev->outq);
+    PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)written);
+    return written;
+}
+
+static ssize_t scull_p_write_iter(struct kiocb *iocb, struct iov_iter *from)
+{
+    struct scull_p_file *pf = iocb->ki_filp->private_data;
+    u64 start = local_clock();
+    ssize_t retval;
+
+    retval = scull_p_do_write_iter(iocb, from);
+    scull_stats_account(&pf->dev->stats, SCULL_STAT_WRITE, retval, start);
+    return retval;
+}
+
+/*
+ * Receive up to vlen records in one call, like recvmmsg(2). Waits for
+ * the first record only.
+ */
+static long scull_p_recvmmsg(struct file *filp, struct scull_p_mmsg __user *umm)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
+    struct scull_p_msg __user *umsg;
+    struct scull_p_mmsg mm;
+    struct scull_p_msg msg;
+    struct iov_iter iter;
+    long received = 0;
+    long retval;
+    u32 len;
+
+    if (copy_from_user(&mm, umm, sizeof(mm)))
+        return -EFAULT;
+    if (mm.flags || !mm.vlen)
+        return -EINVAL;
+    mm.vlen = min_t(u32, mm.vlen, UIO_MAXIOV);
+    umsg = u64_to_user_ptr(mm.msgs);
+    if (!READ_ONCE(dev->packet))
+        return -EINVAL;
+
+    retval = scull_p_lock(dev, &dev->rlock, false);
+    if (retval)
+        return retval;
+    retval = scull_getreaddata(dev, pf, filp->f_flags & O_NONBLOCK);
+    if (retval)
+        return retval;
+    if (!dev->packet)
+    {
+        mutex_unlock(&dev->rlock);
+        return -EINVAL;
+    }
+
+    while (received < mm.vlen && smp_load_acquire(&dev->head) != scull_p_rtail(dev, pf))
+    {
+        if (copy_from_user(&msg, &umsg[received], sizeof(msg)))
+        {
+            retval = -EFAULT;
+            break;
+        }
+        retval = import_ubuf(ITER_DEST, u64_to_user_ptr(msg.buf), msg.len, &iter);
+        if (retval)
+            break;
+        retval = scull_p_read_record(dev, pf, &iter, &len);
+        if (retval < 0)
+            break;
+        received++;
+        if (put_user(len, &umsg[received - 1].msg_len))
+        {
+            retval = -EFAULT;
+            break;
+        }
+    }
+    mutex_unlock(&dev->rlock);
+
+    if (received)
+        scull_p_read_wakeup(dev, pf);
+    return received ? received : retval;
+}
+
+/*
+ * Switching between byte stream and packet mode needs an empty ring,
+ * and no writer waiting for room: it would go on in the old mode.
+ */
+static int scull_p_setpacket(struct scull_pipe *dev, bool packet)
+{
+    int retval = 0;
+
+    mutex_lock(&dev->wlock);
+    mutex_lock(&dev->rlock);
+    if (dev->head != dev->tail || atomic_read(&dev->wwaiting))
+        retval = -EBUSY;
     else
-        count = min(count, (size_t)(dev->rp - dev->wp - 1));
+        dev->packet = packet;
+    mutex_unlock(&dev->rlock);
+    mutex_unlock(&dev->wlock);
+    return retval;
+}
 
-    PDEBUG("Going to accept %li bytes to %p from %p\n", (long)count, dev->wp, buf);
-    if (copy_from_user(dev->wp, buf, count))
+/*
+ * Switching broadcast mode also needs an empty ring; all readers then
+ * start from the current position.
+ */
+static int scull_p_setbcast(struct scull_pipe *dev, unsigned long mode)
+{
+    struct scull_p_file *pf;
+    int retval = 0;
+
+    if (mode > SCULL_P_BCAST_DROP)
+        return -EINVAL;
+
+    mutex_lock(&dev->wlock);
+    mutex_lock(&dev->rlock);
+    if (dev->head != dev->tail)
     {
-        up(&dev->sem);
-        return -EFAULT;
+        retval = -EBUSY;
     }
+    else
+    {
+        list_for_each_entry(pf, &dev->readers, list)
+            pf->tail = dev->head;
+        dev->bcast = mode;
+    }
+    mutex_unlock(&dev->rlock);
+    mutex_unlock(&dev->wlock);
+    return retval;
+}
 
-    dev->wp += count;
-    if (dev->wp == dev->end)
-        dev->wp = dev->buffer;
-    up(&dev->sem);
+/*
+ * The pipe-specific commands. The geometry ones of scull_ioctl() make
+ * no sense on a pipe.
+ */
+static long scull_p_do_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_p_file *pf = filp->private_data;
+    struct scull_pipe *dev = pf->dev;
 
-    wake_up_interruptible(&dev->inq);
+    switch (cmd)
+    {
+    case SCULL_P_IOCTSIZE:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        return scull_p_resize(dev, arg);
 
-    if (dev->async_queue)
-        kill_fasync(&dev->async_queue, SIGIO, POLL_IN);
-    PDEBUG("\"%s\" did write %li bytes\n", current->comm, (long)count);
-    return count;
+    case SCULL_P_IOCQSIZE:
+        return READ_ONCE(dev->buffersize);
+
+    case SCULL_P_IOCTADAPT:
+        if (!capable(CAP_SYS_ADMIN))
+            return -EPERM;
+        if (arg > SCULL_P_MAX_BUFFER)
+            return -EINVAL;
+        mutex_lock(&dev->wlock);
+        dev->adapt_max = arg ? rounddown_pow_of_two(arg) : 0;
+        if (dev->buffersize > max(dev->adapt_max, dev->basesize))
+            schedule_delayed_work(&dev->shrink_work, SCULL_P_IDLE);
+        mutex_unlock(&dev->wlock);
+        return 0;
+
+    case SCULL_P_IOCQADAPT:
+        return READ_ONCE(dev->adapt_max);
+
+    case SCULL_P_IOCTPACKET:
+        return scull_p_setpacket(dev, arg);
+
+    case SCULL_P_IOCQPACKET:
+        return READ_ONCE(dev->packet);
+
+    case SCULL_P_IOCTBCAST:
+        return scull_p_setbcast(dev, arg);
+
+    case SCULL_P_IOCQBCAST:
+        return READ_ONCE(dev->bcast);
+
+    case SCULL_P_IOCTRLOWAT:
+    case SCULL_P_IOCTWLOWAT:
+        if (arg > SCULL_P_MAX_BUFFER)
+            return -EINVAL;
+        if (cmd == SCULL_P_IOCTRLOWAT)
+            WRITE_ONCE(dev->rlowat, max(arg, 1UL));
+        else
+            WRITE_ONCE(dev->wlowat, max(arg, 1UL));
+        wake_up_interruptible_all(&dev->inq);
+        wake_up_interruptible_all(&dev->outq);
+        return 0;
+
+    case SCULL_P_IOCQRLOWAT:
+        return READ_ONCE(dev->rlowat);
+
+    case SCULL_P_IOCQWLOWAT:
+        return READ_ONCE(dev->wlowat);
+
+    case SCULL_P_IOCRECVMMSG:
+        return scull_p_recvmmsg(filp, (struct scull_p_mmsg __user *)arg);
+
+    case SCULL_IOCSTATRESET:
+        scull_stats_reset(&dev->stats);
+        return 0;
+    }
+    return -ENOTTY;
+}
+
+static long scull_p_ioctl(struct file *filp, unsigned int cmd, unsigned long arg)
+{
+    struct scull_p_file *pf = filp->private_data;
+    u64 start = local_clock();
+    long retval;
+
+    retval = scull_p_do_ioctl(filp, cmd, arg);
+    scull_stats_account(&pf->dev->stats, SCULL_STAT_IOCTL, retval, start);
+    return retval;
+}
+
+/*
+ * Extra lines for the debugfs stats file. Unlocked, so only a snapshot.
+ */
+static void scull_p_show(struct seq_file *m, void *priv)
+{
+    struct scull_pipe *dev = priv;
+
+    seq_printf(m, "buffersize %u\n", READ_ONCE(dev->buffersize));
+    seq_printf(m, "buffered %u\n", READ_ONCE(dev->head) - READ_ONCE(dev->tail));
+    seq_printf(m, "readers %d\nwriters %d\n", READ_ONCE(dev->nreaders),
+               READ_ONCE(dev->nwriters));
+    seq_printf(m, "packet %d\nbcast %d\n", READ_ONCE(dev->packet), READ_ONCE(dev->bcast));
 }
 
 struct file_operations scull_pipe_fops = {
     .owner = THIS_MODULE,
     .llseek = no_llseek,
-    .read = scull_p_read,
-    .write = scull_p_write,
+    .read_iter = scull_p_read_iter,
+    .write_iter = scull_p_write_iter,
+    .splice_read = copy_splice_read,
+    .splice_write = iter_file_splice_write,
     .poll = scull_p_poll,
-    .unlocked_ioctl = scull_ioctl,
+    .unlocked_ioctl = scull_p_ioctl,
     .open = scull_p_open,
     .release = scull_p_release,
     .fasync =	scull_p_fasync,
@@ -243,6 +1119,7 @@ static void scull_p_setup_cdev(struct scull_pipe *dev, int index)
 int scull_p_init()
 {
     int i, result;
+    char name[16];
 
     result = alloc_chrdev_region(&scull_p_devno, 0, scull_p_nr_devs, "scullp");
     if (result < 0)
@@ -273,7 +1150,15 @@ int scull_p_init()
     {
         init_waitqueue_head(&(scull_p_devices[i].inq));
         init_waitqueue_head(&(scull_p_devices[i].outq));
+        mutex_init(&scull_p_devices[i].rlock);
+        mutex_init(&scull_p_devices[i].wlock);
+        INIT_LIST_HEAD(&scull_p_devices[i].readers);
+        scull_p_devices[i].rlowat = 1;
+        scull_p_devices[i].wlowat = 1;
         sema_init(&scull_p_devices[i].sem, 1);
+        INIT_DELAYED_WORK(&scull_p_devices[i].shrink_work, scull_p_shrink);
+        snprintf(name, sizeof(name), "scullp%d", i);
+        scull_stats_init(&scull_p_devices[i].stats, name, scull_p_show, scull_p_devices + i);
         device_create(scull_pipe_class, NULL, MKDEV(MAJOR(scull_p_devno), i), NULL, "scullp%d", i);
         scull_p_setup_cdev(scull_p_devices + i, i);
     }
@@ -291,7 +1176,9 @@ void scull_p_cleanup(void)
     for (i = 0; i < scull_p_nr_devs; i++)
     {
         cdev_del(&scull_p_devices[i].cdev);
-        kfree(scull_p_devices[i].buffer);
+        cancel_delayed_work_sync(&scull_p_devices[i].shrink_work);
+        scull_stats_cleanup(&scull_p_devices[i].stats);
+        kvfree(scull_p_devices[i].buffer);
     }
     kfree(scull_p_devices);
     unregister_chrdev_region(scull_p_devno, scull_p_nr_devs);
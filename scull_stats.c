@@ -0,0 +1,147 @@
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/sched/clock.h>
+#include <linux/bitops.h>
+#include <linux/fs.h>
+#include <linux/cdev.h>
+#include <linux/rwsem.h>
+#include <linux/xarray.h>
+#include <linux/workqueue.h>
+
+#include "scull.h"
+
+static struct dentry *scull_debugfs_root;
+
+static const char *const scull_stat_names[SCULL_STAT_NR_OPS] = {
+    [SCULL_STAT_READ] = "read",
+    [SCULL_STAT_WRITE] = "write",
+    [SCULL_STAT_IOCTL] = "ioctl",
+};
+
+void scull_stats_setup(void)
+{
+    scull_debugfs_root = debugfs_create_dir("scull", NULL);
+}
+
+void scull_stats_teardown(void)
+{
+    debugfs_remove_recursive(scull_debugfs_root);
+    scull_debugfs_root = NULL;
+}
+
+/*
+ * Account one operation that started at "start" (local_clock()) and
+ * returned "ret". Only per-CPU counters are touched.
+ */
+void scull_stats_account(struct scull_stats *st, int op, long ret, u64 start)
+{
+    u64 ns;
+    int bucket;
+
+    if (!st->cpu)
+        return;
+    ns = local_clock() - start;
+    bucket = min_t(int, fls64(ns), SCULL_STAT_BUCKETS - 1);
+    this_cpu_inc(st->cpu->ops[op]);
+    if (ret == -EAGAIN)
+        this_cpu_inc(st->cpu->eagain[op]);
+    else if (ret < 0)
+        this_cpu_inc(st->cpu->errors[op]);
+    else if (op != SCULL_STAT_IOCTL)
+        this_cpu_add(st->cpu->bytes[op], ret);
+    this_cpu_inc(st->cpu->lat[op][bucket]);
+}
+
+void scull_stats_contended(struct scull_stats *st)
+{
+    if (st->cpu)
+        this_cpu_inc(st->cpu->contended);
+}
+
+void scull_stats_blocked(struct scull_stats *st, u64 start)
+{
+    if (st->cpu)
+        this_cpu_add(st->cpu->blocked_ns, local_clock() - start);
+}
+
+void scull_stats_reset(struct scull_stats *st)
+{
+    int cpu;
+
+    if (!st->cpu)
+        return;
+    for_each_possible_cpu(cpu)
+        memset(per_cpu_ptr(st->cpu, cpu), 0, sizeof(struct scull_stats_cpu));
+}
+
+static int scull_stats_show(struct seq_file *m, void *v)
+{
+    struct scull_stats *st = m->private;
+    struct scull_stats_cpu sum, *c;
+    int cpu, op, i;
+
+    memset(&sum, 0, sizeof(sum));
+    for_each_possible_cpu(cpu)
+    {
+        c = per_cpu_ptr(st->cpu, cpu);
+        for (op = 0; op < SCULL_STAT_NR_OPS; op++)
+        {
+            sum.ops[op] += READ_ONCE(c->ops[op]);
+            sum.bytes[op] += READ_ONCE(c->bytes[op]);
+            sum.errors[op] += READ_ONCE(c->errors[op]);
+            sum.eagain[op] += READ_ONCE(c->eagain[op]);
+            for (i = 0; i < SCULL_STAT_BUCKETS; i++)
+                sum.lat[op][i] += READ_ONCE(c->lat[op][i]);
+        }
+        sum.contended += READ_ONCE(c->contended);
+        sum.blocked_ns += READ_ONCE(c->blocked_ns);
+    }
+
+    for (op = 0; op < SCULL_STAT_NR_OPS; op++)
+    {
+        seq_printf(m, "%s_ops %llu\n", scull_stat_names[op], sum.ops[op]);
+        if (op != SCULL_STAT_IOCTL)
+            seq_printf(m, "%s_bytes %llu\n", scull_stat_names[op], sum.bytes[op]);
+        seq_printf(m, "%s_errors %llu\n", scull_stat_names[op], sum.errors[op]);
+        seq_printf(m, "%s_eagain %llu\n", scull_stat_names[op], sum.eagain[op]);
+        /* bucket i counts latencies in [2^(i-1), 2^i) ns */
+        seq_printf(m, "%s_latency_log2_ns", scull_stat_names[op]);
+        for (i = 0; i < SCULL_STAT_BUCKETS; i++)
+            seq_printf(m, " %llu", sum.lat[op][i]);
+        seq_putc(m, '\n');
+    }
+    seq_printf(m, "lock_contended %llu\n", sum.contended);
+    seq_printf(m, "blocked_ns %llu\n", sum.blocked_ns);
+
+    if (st->show)
+        st->show(m, st->priv);
+    return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(scull_stats);
+
+/*
+ * Statistics are best effort: without the per-CPU area the device just
+ * goes uncounted, and a missing debugfs is not an error either.
+ */
+void scull_stats_init(struct scull_stats *st, const char *name,
+                      void (*show)(struct seq_file *, void *), void *priv)
+{
+    st->cpu = alloc_percpu(struct scull_stats_cpu);
+    if (!st->cpu)
+        return;
+    st->show = show;
+    st->priv = priv;
+    st->dir = debugfs_create_dir(name, scull_debugfs_root);
+    debugfs_create_file("stats", 0444, st->dir, st, &scull_stats_fops);
+}
+
+void scull_stats_cleanup(struct scull_stats *st)
+{
+    debugfs_remove_recursive(st->dir);
+    st->dir = NULL;
+    free_percpu(st->cpu);
+    st->cpu = NULL;
+}
@@ -0,0 +1,145 @@
+/*
+ * scull_trace.h -- tracepoints for the scull devices
+ *
+ * The events cost a static branch when disabled; enable them through
+ * tracefs (events/scull/) or perf.
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM scull
+
+#if !defined(_SCULL_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _SCULL_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+DECLARE_EVENT_CLASS(scull_io,
+
+	TP_PROTO(unsigned int minor, loff_t offset, size_t count,
+		 ssize_t ret, u64 latency),
+
+	TP_ARGS(minor, offset, count, ret, latency),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(loff_t,		offset)
+		__field(size_t,		count)
+		__field(ssize_t,	ret)
+		__field(u64,		latency)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offset = offset;
+		__entry->count = count;
+		__entry->ret = ret;
+		__entry->latency = latency;
+	),
+
+	TP_printk("minor=%u offset=%lld count=%zu ret=%zd latency=%lluns",
+		  __entry->minor, __entry->offset, __entry->count,
+		  __entry->ret, __entry->latency)
+);
+
+DEFINE_EVENT(scull_io, scull_read,
+	TP_PROTO(unsigned int minor, loff_t offset, size_t count,
+		 ssize_t ret, u64 latency),
+	TP_ARGS(minor, offset, count, ret, latency)
+);
+
+DEFINE_EVENT(scull_io, scull_write,
+	TP_PROTO(unsigned int minor, loff_t offset, size_t count,
+		 ssize_t ret, u64 latency),
+	TP_ARGS(minor, offset, count, ret, latency)
+);
+
+TRACE_EVENT(scull_llseek,
+
+	TP_PROTO(unsigned int minor, loff_t offset, int whence, loff_t ret),
+
+	TP_ARGS(minor, offset, whence, ret),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(loff_t,		offset)
+		__field(int,		whence)
+		__field(loff_t,		ret)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->offset = offset;
+		__entry->whence = whence;
+		__entry->ret = ret;
+	),
+
+	TP_printk("minor=%u offset=%lld whence=%d ret=%lld",
+		  __entry->minor, __entry->offset, __entry->whence,
+		  __entry->ret)
+);
+
+TRACE_EVENT(scull_ioctl,
+
+	TP_PROTO(unsigned int minor, unsigned int cmd, unsigned long arg,
+		 long ret, u64 latency),
+
+	TP_ARGS(minor, cmd, arg, ret, latency),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(unsigned int,	cmd)
+		__field(unsigned long,	arg)
+		__field(long,		ret)
+		__field(u64,		latency)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->cmd = cmd;
+		__entry->arg = arg;
+		__entry->ret = ret;
+		__entry->latency = latency;
+	),
+
+	TP_printk("minor=%u cmd=0x%x arg=0x%lx ret=%ld latency=%lluns",
+		  __entry->minor, __entry->cmd, __entry->arg,
+		  __entry->ret, __entry->latency)
+);
+
+DECLARE_EVENT_CLASS(scull_file,
+
+	TP_PROTO(unsigned int minor, unsigned int flags),
+
+	TP_ARGS(minor, flags),
+
+	TP_STRUCT__entry(
+		__field(unsigned int,	minor)
+		__field(unsigned int,	flags)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->flags = flags;
+	),
+
+	TP_printk("minor=%u flags=0%o", __entry->minor, __entry->flags)
+);
+
+DEFINE_EVENT(scull_file, scull_open,
+	TP_PROTO(unsigned int minor, unsigned int flags),
+	TP_ARGS(minor, flags)
+);
+
+DEFINE_EVENT(scull_file, scull_release,
+	TP_PROTO(unsigned int minor, unsigned int flags),
+	TP_ARGS(minor, flags)
+);
+
+#endif /* _SCULL_TRACE_H_ */
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE scull_trace
+#include <trace/define_trace.h>